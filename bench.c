@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "uthreads.h"
+
+/*
+ * Micro-benchmarks of the thread library. Every benchmark prints one line of key=value pairs:
+ *
+ *   bench=<name> threads=<n> ops=<samples> mean_ns=... p50_ns=... p90_ns=... p99_ns=... max_ns=...
+ *
+ * so runs from two commits can be compared with diff or a few lines of awk. Times come from
+ * CLOCK_MONOTONIC and include the cost of one clock read (about 20 ns through the vDSO).
+ *
+ *   yield_pingpong  one switch between two threads that yield to each other
+ *   yield_ring      one switch in a ring of n threads that all yield (scheduler pick cost as n grows)
+ *   spawn_exit      spawning a thread that runs, returns and is reaped
+ *   spawn_terminate spawning a thread and terminating it before it ever runs
+ *   block_resume    from uthread_resume of a blocked thread until it runs again
+ *   timer_tick      CPU time a running thread loses to one timer tick (signal, handler, reschedule)
+ *
+ * Usage: bench [ops] [max_threads]
+ */
+
+#define DEFAULT_OPS 100000
+#define DEFAULT_MAX_THREADS 1024
+#define BENCH_QUANTUM_USECS 1000000
+#define TICK_QUANTUM_USECS 1000
+#define TICK_SPIN_NS 2000000000LL
+
+static long long *samples;
+static int num_samples;
+static int max_samples;
+static volatile long long switch_start;
+static volatile int stop;
+static volatile int running;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void record(long long ns) {
+    if (num_samples < max_samples) {
+        samples[num_samples++] = ns;
+    }
+}
+
+static int compare_samples(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Prints the line of one benchmark and starts a new set of samples
+static void report(const char *name, int threads) {
+    if (num_samples == 0) {
+        printf("bench=%s threads=%d ops=0\n", name, threads);
+        return;
+    }
+    qsort(samples, num_samples, sizeof(long long), compare_samples);
+    long long total = 0;
+    for (int i = 0; i < num_samples; i++) {
+        total += samples[i];
+    }
+    printf("bench=%s threads=%d ops=%d mean_ns=%lld p50_ns=%lld p90_ns=%lld p99_ns=%lld max_ns=%lld\n",
+           name, threads, num_samples, total / num_samples, samples[num_samples / 2],
+           samples[(long long)num_samples * 90 / 100], samples[(long long)num_samples * 99 / 100],
+           samples[num_samples - 1]);
+    fflush(stdout);
+    num_samples = 0;
+}
+
+// Yields until stopped; every return from uthread_yield times the switch that brought us back
+static void yielder(void) {
+    running++;
+    while (!stop) {
+        switch_start = now_ns();
+        uthread_yield();
+        record(now_ns() - switch_start);
+    }
+    running--;
+}
+
+static void yield_bench(const char *name, int threads, int ops) {
+    stop = 0;
+    for (int i = 1; i < threads; i++) {
+        if (uthread_spawn(yielder) == -1) {
+            fprintf(stderr, "Failed to spawn thread %d of %d\n", i, threads);
+            exit(1);
+        }
+    }
+    // let every thread take its first turn, so that no sample includes a thread's startup
+    while (running < threads - 1) {
+        uthread_yield();
+    }
+    num_samples = 0;
+    max_samples = ops;
+    while (num_samples < ops) {
+        switch_start = now_ns();
+        uthread_yield();
+        record(now_ns() - switch_start);
+    }
+    stop = 1;
+    while (running > 0) {
+        uthread_yield();
+    }
+    report(name, threads);
+}
+
+static void short_lived(void) {
+}
+
+static void never_runs(void) {
+    abort();
+}
+
+static void spawn_bench(int ops) {
+    max_samples = ops;
+    for (int i = 0; i < ops; i++) {
+        long long start = now_ns();
+        if (uthread_spawn(short_lived) == -1) {
+            fprintf(stderr, "Failed to spawn thread\n");
+            exit(1);
+        }
+        // the thread runs, returns and is reaped by the switch back to us
+        uthread_yield();
+        record(now_ns() - start);
+    }
+    report("spawn_exit", 2);
+
+    for (int i = 0; i < ops; i++) {
+        long long start = now_ns();
+        int tid = uthread_spawn(never_runs);
+        if (tid == -1 || uthread_terminate(tid) == -1) {
+            fprintf(stderr, "Failed to spawn or terminate thread\n");
+            exit(1);
+        }
+        record(now_ns() - start);
+    }
+    report("spawn_terminate", 2);
+}
+
+static volatile long long resume_start;
+
+static void sleeper(void) {
+    running = 1;
+    while (!stop) {
+        uthread_block(uthread_get_tid());
+        record(now_ns() - resume_start);
+    }
+    running = 0;
+}
+
+static void block_resume_bench(int ops) {
+    stop = 0;
+    num_samples = 0;
+    max_samples = ops;
+    int tid = uthread_spawn(sleeper);
+    if (tid == -1) {
+        fprintf(stderr, "Failed to spawn thread\n");
+        exit(1);
+    }
+    // the sleeper blocks itself on its first turn
+    uthread_yield();
+    while (num_samples < ops) {
+        resume_start = now_ns();
+        uthread_resume(tid);
+        uthread_yield();
+    }
+    stop = 1;
+    uthread_resume(tid);
+    while (running) {
+        uthread_yield();
+    }
+    report("block_resume", 2);
+}
+
+// Spins reading the clock: a timer tick shows up as one gap much longer than a loop iteration.
+// The longest gaps, one per tick taken, are the samples.
+static void timer_tick_bench() {
+    int capacity = 1 << 20;
+    long long *gaps = malloc(capacity * sizeof(long long));
+    if (gaps == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    int num_gaps = 0;
+    uthread_set_quantum(0, TICK_QUANTUM_USECS);
+    int quantums_before = uthread_get_quantums(0);
+    long long start = now_ns();
+    long long last = start;
+    while (last - start < TICK_SPIN_NS) {
+        long long t = now_ns();
+        if (num_gaps < capacity) {
+            gaps[num_gaps++] = t - last;
+        }
+        last = t;
+    }
+    int ticks = uthread_get_quantums(0) - quantums_before;
+    uthread_set_quantum(0, 0);
+
+    qsort(gaps, num_gaps, sizeof(long long), compare_samples);
+    num_samples = 0;
+    max_samples = ticks;
+    for (int i = num_gaps - ticks; i < num_gaps; i++) {
+        record(gaps[i]);
+    }
+    report("timer_tick", 1);
+    free(gaps);
+}
+
+int main(int argc, char **argv) {
+    int ops = (argc > 1) ? atoi(argv[1]) : DEFAULT_OPS;
+    int max_threads = (argc > 2) ? atoi(argv[2]) : DEFAULT_MAX_THREADS;
+    if (ops <= 0 || max_threads < 2) {
+        fprintf(stderr, "usage: %s [ops] [max_threads]\n", argv[0]);
+        return 1;
+    }
+    samples = malloc(ops * sizeof(long long));
+    if (samples == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // quantums far longer than any measurement, so ticks don't land in the samples
+    if (uthread_init(BENCH_QUANTUM_USECS) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+
+    yield_bench("yield_pingpong", 2, ops);
+    for (int threads = 2; threads <= max_threads; threads *= 2) {
+        yield_bench("yield_ring", threads, ops);
+    }
+    spawn_bench(ops);
+    block_resume_bench(ops);
+    timer_tick_bench();
+
+    free(samples);
+    return 0;
+}
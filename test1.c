@@ -7,23 +7,7 @@
 #include <stdint.h>
 #include "uthreads.h"
 atomic_int done;
-
-void userland_sleep(int usecs)
-{
-    struct timespec start, current;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-
-    uint64_t nanos = usecs * 1e3;
-
-    while (1)
-    {
-        clock_gettime(CLOCK_MONOTONIC, &current);
-        uint64_t elapsed = (current.tv_sec - start.tv_sec) * 1e9 +
-                           (current.tv_nsec - start.tv_nsec);
-        if (elapsed >= nanos)
-            break;
-    }
-}
+uthread_sem_t finished;
 
 void f()
 {
@@ -32,9 +16,10 @@ void f()
     {
         printf("Thread %d: %d\n", tid, i);
         int x = 0;
-        userland_sleep(200);
+        uthread_sleep_usec(200);
     }
     atomic_fetch_add(&done, 1);
+    uthread_sem_post(&finished);
     uthread_terminate(tid);
 }
 
@@ -44,11 +29,17 @@ int main(void)
     atomic_store(&done, 0);
     printf("atomic store done");
     uthread_init(1000);
+    uthread_sem_init(&finished, 0);
     uthread_spawn(f);
     uthread_spawn(f);
-    while (atomic_load(&done) < 2)
+    // wait without spinning: main is BLOCKED until both threads post
+    uthread_sem_wait(&finished);
+    uthread_sem_wait(&finished);
+    if (atomic_load(&done) != 2)
     {
-    };
+        printf("Woke up before both threads finished!\n");
+        return 1;
+    }
     printf("Done!\n");
     uthread_terminate(0);
     return 0;
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include "uthreads.h"
+
+// Per-thread quantum lengths: two CPU-bound threads with quantums of their own get slices of those
+// lengths, and uthread_set_quantum changes a thread's length from its next switch in on.
+// CPU-time timers fire on kernel ticks, so a slice may run up to a tick longer than its quantum.
+
+#define LIBRARY_QUANTUM 20000
+#define SHORT_QUANTUM 8000
+#define LONG_QUANTUM 40000
+#define PHASE_USECS 400000
+#define TICK_USECS 10000
+
+volatile int stop;
+volatile int owner = -1; // spinner that ran last
+long long slice_sum[2];
+int slice_count[2];
+int short_tid, long_tid;
+int failed;
+uthread_sem_t done;
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Spins and measures its slices: a slice ends when the other spinner ran in between
+void spinner(int index) {
+    long long slice_start = 0, last = 0;
+    while (!stop) {
+        long long t = now_us();
+        if (owner != index) {
+            if (slice_start != 0) {
+                slice_sum[index] += last - slice_start;
+                slice_count[index]++;
+            }
+            owner = index;
+            // t may be from before the switch
+            t = now_us();
+            slice_start = t;
+        }
+        last = t;
+    }
+    uthread_sem_post(&done);
+}
+
+void short_spinner(void) {
+    spinner(0);
+}
+
+void long_spinner(void) {
+    spinner(1);
+}
+
+// True if a slice of the given average length is one of a quantum of the given length
+bool close_to(long long average, int quantum) {
+    return average >= quantum / 2 && average <= quantum * 2 + TICK_USECS;
+}
+
+// Lets the spinners run for a while, and returns their average slices
+void measure(long long average[2]) {
+    stop = 0;
+    for (int i = 0; i < 2; i++) {
+        slice_sum[i] = 0;
+        slice_count[i] = 0;
+    }
+    uthread_sleep_usec(PHASE_USECS);
+    for (int i = 0; i < 2; i++) {
+        average[i] = slice_count[i] > 0 ? slice_sum[i] / slice_count[i] : 0;
+    }
+}
+
+// Runs both phases while the main thread waits (it can't sleep)
+void controller(void) {
+    long long average[2];
+    measure(average);
+    if (!close_to(average[0], SHORT_QUANTUM) || !close_to(average[1], LONG_QUANTUM) || average[0] * 2 > average[1]) {
+        fprintf(stderr, "Slices of %lld and %lld us, expected %d and %d\n", average[0], average[1],
+                SHORT_QUANTUM, LONG_QUANTUM);
+        failed = 1;
+    }
+    printf("Own quantums: slices of %lld and %lld us\n", average[0], average[1]);
+
+    // back to the library's quantum, and a new length for the other one
+    if (uthread_set_quantum(short_tid, 0) == -1 || uthread_set_quantum(long_tid, SHORT_QUANTUM) == -1) {
+        fprintf(stderr, "uthread_set_quantum failed\n");
+        failed = 1;
+    }
+    if (uthread_set_quantum(short_tid, -1) != -1) {
+        fprintf(stderr, "Set a negative quantum\n");
+        failed = 1;
+    }
+    measure(average);
+    if (!close_to(average[0], LIBRARY_QUANTUM) || !close_to(average[1], SHORT_QUANTUM) || average[1] > average[0]) {
+        fprintf(stderr, "After uthread_set_quantum: slices of %lld and %lld us, expected %d and %d\n",
+                average[0], average[1], LIBRARY_QUANTUM, SHORT_QUANTUM);
+        failed = 1;
+    }
+    printf("Changed quantums: slices of %lld and %lld us\n", average[0], average[1]);
+    stop = 1;
+    uthread_sem_post(&done);
+}
+
+int main() {
+    if (uthread_init(LIBRARY_QUANTUM) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    uthread_attr_t bad = { .quantum_usecs = -1 };
+    if (uthread_spawn_ex(short_spinner, &bad) != -1) {
+        fprintf(stderr, "Spawned a thread with a negative quantum\n");
+        return 1;
+    }
+
+    uthread_attr_t short_attr = { .quantum_usecs = SHORT_QUANTUM };
+    uthread_attr_t long_attr = { .quantum_usecs = LONG_QUANTUM };
+    short_tid = uthread_spawn_ex(short_spinner, &short_attr);
+    long_tid = uthread_spawn_ex(long_spinner, &long_attr);
+    uthread_spawn(controller);
+    for (int i = 0; i < 3; i++) {
+        uthread_sem_wait(&done);
+    }
+    if (failed) {
+        return 1;
+    }
+    printf("Done!\n");
+    return 0;
+}
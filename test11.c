@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include "uthreads.h"
+
+// MLFQ: a thread that yields after a tenth of its quantum is never cut by the timer, so it stays on
+// level 0 while CPU-bound threads sink. Since only a timer cut demotes a thread, it must have no
+// involuntary switches, and it runs far more often than the CPU-bound threads.
+
+#define QUANTUM_USECS 10000
+#define WORK_USECS (QUANTUM_USECS / 10)
+#define ROUNDS 300
+#define HOGS 2
+
+volatile int stop;
+volatile long hog_rounds;
+uthread_stats_t stats;
+int stats_result;
+uthread_sem_t done;
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void hog(void) {
+    while (!stop) {
+        hog_rounds++;
+    }
+    uthread_sem_post(&done);
+}
+
+void interactive(void) {
+    for (int i = 0; i < ROUNDS; i++) {
+        long long start = now_us();
+        while (now_us() - start < WORK_USECS);
+        uthread_yield();
+    }
+    // before the thread terminates
+    stats_result = uthread_get_stats(uthread_get_tid(), &stats);
+    stop = 1;
+    uthread_sem_post(&done);
+}
+
+int main() {
+    uthread_init_attr_t attr = { .policy = UTHREAD_SCHED_MLFQ };
+    if (uthread_init_ex(QUANTUM_USECS, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    for (int i = 0; i < HOGS; i++) {
+        uthread_spawn(hog);
+    }
+    uthread_spawn(interactive);
+    for (int i = 0; i < HOGS + 1; i++) {
+        uthread_sem_wait(&done);
+    }
+
+    if (stats_result == -1) {
+        fprintf(stderr, "uthread_get_stats failed\n");
+        return 1;
+    }
+    if (stats.involuntary_switches != 0) {
+        fprintf(stderr, "The interactive thread was cut by the timer %lld times\n", stats.involuntary_switches);
+        return 1;
+    }
+    printf("interactive: %d rounds, %lld voluntary switches, run %lld ms of %lld ms\n", ROUNDS,
+           stats.voluntary_switches, stats.run_ns / 1000000, stats.elapsed_ns / 1000000);
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include "uthreads.h"
+
+// Direct handoff: uthread_switch_to runs its target right away, two threads calling uthread_switch_to_block
+// for each other run as coroutines, and handoffs don't end quantums. The quantum is long enough that the
+// timer never interferes.
+
+#define QUANTUM_USECS 1000000
+#define HANDOFFS 1000
+
+int order[3], order_count;
+int turns[2 * HANDOFFS], turn_count;
+int ping_tid, pong_tid;
+int quantums_before, quantums_after;
+volatile int waiter_ran;
+uthread_sem_t done, never;
+
+void first(void) {
+    order[order_count++] = 1;
+    uthread_sem_post(&done);
+}
+
+void second(void) {
+    order[order_count++] = 2;
+    uthread_sem_post(&done);
+}
+
+void ping(void) {
+    quantums_before = uthread_get_total_quantums();
+    for (int i = 0; i < HANDOFFS; i++) {
+        turns[turn_count++] = 1;
+        uthread_switch_to_block(pong_tid);
+    }
+    uthread_sem_post(&done);
+}
+
+void pong(void) {
+    for (int i = 0; i < HANDOFFS; i++) {
+        turns[turn_count++] = 2;
+        if (i < HANDOFFS - 1) {
+            uthread_switch_to_block(ping_tid);
+        }
+    }
+    quantums_after = uthread_get_total_quantums();
+    // let ping finish, staying READY
+    uthread_switch_to(ping_tid);
+    uthread_sem_post(&done);
+}
+
+// Waits on a semaphore nobody posts: a handoff to it can't resume it
+void waiter(void) {
+    uthread_sem_wait(&never);
+    waiter_ran = 1;
+}
+
+int main() {
+    if (uthread_init(QUANTUM_USECS) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+    uthread_sem_init(&never, 0);
+
+    if (uthread_switch_to(0) != -1 || uthread_switch_to(42) != -1) {
+        fprintf(stderr, "Switched to the caller or to a thread that doesn't exist\n");
+        return 1;
+    }
+    int first_tid = uthread_spawn(first);
+    if (uthread_switch_to_block(first_tid) != -1) {
+        fprintf(stderr, "Blocked the main thread\n");
+        return 1;
+    }
+
+    // the target jumps the READY queue
+    int second_tid = uthread_spawn(second);
+    uthread_switch_to(second_tid);
+    uthread_sem_wait(&done);
+    uthread_sem_wait(&done);
+    if (order_count != 2 || order[0] != 2 || order[1] != 1) {
+        fprintf(stderr, "Threads ran in the wrong order\n");
+        return 1;
+    }
+
+    // symmetric coroutines
+    ping_tid = uthread_spawn(ping);
+    pong_tid = uthread_spawn(pong);
+    uthread_sem_wait(&done);
+    uthread_sem_wait(&done);
+    if (turn_count != 2 * HANDOFFS) {
+        fprintf(stderr, "%d turns, expected %d\n", turn_count, 2 * HANDOFFS);
+        return 1;
+    }
+    for (int i = 0; i < turn_count; i++) {
+        if (turns[i] != 1 + i % 2) {
+            fprintf(stderr, "Turn %d went to the wrong thread\n", i);
+            return 1;
+        }
+    }
+    if (quantums_after != quantums_before) {
+        fprintf(stderr, "%d handoffs ended %d quantums\n", 2 * HANDOFFS, quantums_after - quantums_before);
+        return 1;
+    }
+
+    // a thread waiting for something else stays waiting: the handoff falls back to the scheduler
+    int waiter_tid = uthread_spawn(waiter);
+    uthread_yield();
+    if (uthread_switch_to(waiter_tid) != 0 || waiter_ran) {
+        fprintf(stderr, "A handoff woke a thread waiting on a semaphore\n");
+        return 1;
+    }
+    uthread_sem_post(&never);
+    while (!waiter_ran) {
+        uthread_yield();
+    }
+
+    printf("%d handoffs in order\n", turn_count);
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include "uthreads.h"
+
+// uthread_get_stats: a sleeping thread's time is BLOCKED time, two threads sharing the CPU each run about
+// half the time and wait READY the other half, the timer's preemptions count as involuntary switches, and
+// the scheduler counters only grow.
+
+#define QUANTUM_USECS 10000
+#define SLEEP_USECS 100000
+#define SPIN_USECS 300000
+#define MS 1000000LL
+
+volatile int stop;
+uthread_stats_t sleeper_stats, spinner_stats[2];
+uthread_sem_t done;
+
+// Reads its own statistics (a terminated thread has none)
+void sleeper(void) {
+    uthread_sleep_usec(SLEEP_USECS);
+    uthread_get_stats(uthread_get_tid(), &sleeper_stats);
+    uthread_sem_post(&done);
+}
+
+void spinner(int index) {
+    while (!stop);
+    uthread_get_stats(uthread_get_tid(), &spinner_stats[index]);
+    uthread_sem_post(&done);
+}
+
+void first_spinner(void) {
+    spinner(0);
+}
+
+void second_spinner(void) {
+    spinner(1);
+}
+
+void controller(void) {
+    uthread_sleep_usec(SPIN_USECS);
+    stop = 1;
+    uthread_sem_post(&done);
+}
+
+int main() {
+    if (uthread_init(QUANTUM_USECS) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    uthread_stats_t before, after;
+    if (uthread_get_stats(42, &before) != -1 || uthread_get_stats(0, NULL) != -1) {
+        fprintf(stderr, "uthread_get_stats accepted a missing thread or a NULL pointer\n");
+        return 1;
+    }
+    uthread_get_stats(0, &before);
+
+    uthread_spawn(sleeper);
+    uthread_sem_wait(&done);
+    if (sleeper_stats.blocked_ns < SLEEP_USECS * 1000LL * 9 / 10 || sleeper_stats.voluntary_switches < 1) {
+        fprintf(stderr, "Sleeper: blocked %lld ms, %lld voluntary switches\n", sleeper_stats.blocked_ns / MS,
+                sleeper_stats.voluntary_switches);
+        return 1;
+    }
+
+    uthread_spawn(first_spinner);
+    uthread_spawn(second_spinner);
+    uthread_spawn(controller);
+    for (int i = 0; i < 3; i++) {
+        uthread_sem_wait(&done);
+    }
+    for (int i = 0; i < 2; i++) {
+        uthread_stats_t *stats = &spinner_stats[i];
+        long long half = SPIN_USECS * 1000LL / 2;
+        if (stats->run_ns < half / 2 || stats->run_ns > half * 2 || stats->ready_ns < half / 2 ||
+            stats->ready_ns > half * 2) {
+            fprintf(stderr, "Spinner %d: ran %lld ms and waited %lld ms of %lld\n", i, stats->run_ns / MS,
+                    stats->ready_ns / MS, SPIN_USECS / 1000LL);
+            return 1;
+        }
+        if (stats->involuntary_switches < 3 || stats->max_ready_ns > 5 * QUANTUM_USECS * 1000LL) {
+            fprintf(stderr, "Spinner %d: %lld involuntary switches, longest wait %lld ms\n", i,
+                    stats->involuntary_switches, stats->max_ready_ns / MS);
+            return 1;
+        }
+    }
+
+    uthread_get_stats(0, &after);
+    if (after.total_switches <= before.total_switches || after.ticks_taken <= before.ticks_taken ||
+        after.elapsed_ns <= before.elapsed_ns) {
+        fprintf(stderr, "Scheduler counters did not grow\n");
+        return 1;
+    }
+    long long accounted = after.run_ns + after.ready_ns + after.blocked_ns;
+    if (accounted > after.elapsed_ns + MS || accounted < after.elapsed_ns / 2) {
+        fprintf(stderr, "Main thread: %lld ms accounted of %lld ms\n", accounted / MS, after.elapsed_ns / MS);
+        return 1;
+    }
+
+    printf("spinners ran %lld and %lld ms, %lld switches, %lld ticks\n", spinner_stats[0].run_ns / MS,
+           spinner_stats[1].run_ns / MS, after.total_switches, after.ticks_taken);
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "uthreads.h"
+
+// Tracing: the dump is valid JSON, and every thread's track has exactly the events it went through,
+// including those of direct handoffs. The quantum is long enough that no tick events get in.
+
+#define QUANTUM_USECS 1000000
+#define HANDOFFS 100
+
+int ping_tid, pong_tid;
+volatile int finished;
+
+void sleeper(void) {
+    uthread_sleep_usec(1000);
+    finished++;
+}
+
+void blockee(void) {
+    finished++;
+}
+
+void ping(void) {
+    for (int i = 0; i < HANDOFFS; i++) {
+        uthread_switch_to_block(pong_tid);
+    }
+    finished++;
+}
+
+void pong(void) {
+    for (int i = 0; i < HANDOFFS - 1; i++) {
+        uthread_switch_to_block(ping_tid);
+    }
+    uthread_switch_to(ping_tid);
+    finished++;
+}
+
+// A small JSON parser that only checks the syntax: each function consumes a value and returns the rest,
+// or NULL on an error
+const char *parse_value(const char *p);
+
+const char *skip_space(const char *p) {
+    while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+const char *parse_string(const char *p) {
+    if (*p++ != '"') {
+        return NULL;
+    }
+    while (*p != '"') {
+        if (*p == '\0' || (unsigned char)*p < 0x20) {
+            return NULL;
+        }
+        if (*p == '\\') {
+            p++;
+            if (*p == '\0') {
+                return NULL;
+            }
+        }
+        p++;
+    }
+    return p + 1;
+}
+
+// Parses an object or an array: elements separated by commas between open and close
+const char *parse_container(const char *p, char close, int object) {
+    p = skip_space(p + 1);
+    if (*p == close) {
+        return p + 1;
+    }
+    while (1) {
+        if (object) {
+            p = parse_string(p);
+            if (p == NULL || *(p = skip_space(p)) != ':') {
+                return NULL;
+            }
+            p++;
+        }
+        p = parse_value(p);
+        if (p == NULL) {
+            return NULL;
+        }
+        p = skip_space(p);
+        if (*p == close) {
+            return p + 1;
+        }
+        if (*p++ != ',') {
+            return NULL;
+        }
+    }
+}
+
+const char *parse_value(const char *p) {
+    p = skip_space(p);
+    if (*p == '{') {
+        return parse_container(p, '}', 1);
+    }
+    if (*p == '[') {
+        return parse_container(p, ']', 0);
+    }
+    if (*p == '"') {
+        return parse_string(p);
+    }
+    const char *literals[] = { "true", "false", "null" };
+    for (int i = 0; i < 3; i++) {
+        if (strncmp(p, literals[i], strlen(literals[i])) == 0) {
+            return p + strlen(literals[i]);
+        }
+    }
+    char *end;
+    strtod(p, &end);
+    return (end == p) ? NULL : end;
+}
+
+// Number of instant events of the given name on a thread's track
+int count_events(const char *json, const char *name, int tid) {
+    char pattern[128];
+    snprintf(pattern, sizeof(pattern), "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,", name, tid);
+    int count = 0;
+    for (const char *p = strstr(json, pattern); p != NULL; p = strstr(p + 1, pattern)) {
+        count++;
+    }
+    return count;
+}
+
+int main() {
+    if (uthread_init(QUANTUM_USECS) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    if (uthread_trace_dump(stdout) != -1) {
+        fprintf(stderr, "Dumped a trace that was never started\n");
+        return 1;
+    }
+    if (uthread_trace_start(1 << 16) == -1) {
+        fprintf(stderr, "uthread_trace_start failed\n");
+        return 1;
+    }
+
+    int sleeper_tid = uthread_spawn(sleeper);
+    int blockee_tid = uthread_spawn(blockee);
+    uthread_block(blockee_tid);
+    ping_tid = uthread_spawn(ping);
+    pong_tid = uthread_spawn(pong);
+    uthread_resume(blockee_tid);
+    while (finished < 4) {
+        uthread_yield();
+    }
+    // the threads terminate when they return
+    uthread_yield();
+    uthread_trace_stop();
+
+    FILE *file = tmpfile();
+    if (file == NULL || uthread_trace_dump(file) == -1) {
+        fprintf(stderr, "uthread_trace_dump failed\n");
+        return 1;
+    }
+    long size = ftell(file);
+    char *json = malloc(size + 1);
+    rewind(file);
+    if (json == NULL || fread(json, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Failed to read the trace back\n");
+        return 1;
+    }
+    json[size] = '\0';
+    fclose(file);
+    const char *rest = parse_value(json);
+    if (rest == NULL || *skip_space(rest) != '\0' || strstr(json, "\"traceEvents\":[") == NULL) {
+        fprintf(stderr, "The trace is not valid JSON\n");
+        return 1;
+    }
+
+    // spawn, block, resume, sleep, wake, terminate for each thread
+    struct {
+        int tid;
+        int counts[6];
+    } expected[] = {
+        { sleeper_tid, { 1, 0, 0, 1, 1, 1 } },
+        { blockee_tid, { 1, 1, 1, 0, 1, 1 } },
+        // every handoff blocks the caller and resumes the other, except the first (pong is READY) and the
+        // last (ping doesn't block)
+        { ping_tid, { 1, HANDOFFS, HANDOFFS, 0, HANDOFFS, 1 } },
+        { pong_tid, { 1, HANDOFFS - 1, HANDOFFS - 1, 0, HANDOFFS - 1, 1 } },
+    };
+    const char *names[] = { "spawn", "block", "resume", "sleep", "wake", "terminate" };
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 6; j++) {
+            int count = count_events(json, names[j], expected[i].tid);
+            if (count != expected[i].counts[j]) {
+                fprintf(stderr, "Thread %d: %d %s events, expected %d\n", expected[i].tid, count, names[j],
+                        expected[i].counts[j]);
+                return 1;
+            }
+        }
+    }
+
+    printf("%ld bytes of trace\n", size);
+    free(json);
+    printf("Done!\n");
+    return 0;
+}
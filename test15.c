@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "uthreads.h"
+
+// The sampling profiler: samples are attributed to the uthread that was running, a thread that sleeps
+// gets none, stacks that print the same share a line, and samples that don't fit are counted. Stacks only
+// print the same across call sites when built with -rdynamic -fno-omit-frame-pointer.
+
+#define INTERVAL_USECS 1000
+#define SPIN_USECS 200000
+#define CHURN_THREADS 2000
+
+uthread_sem_t done;
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Spins for usecs of wall-clock time, sharing the CPU with whoever else is READY
+void spin(long long usecs) {
+    long long start = now_us();
+    while (now_us() - start < usecs);
+}
+
+void long_spinner(void) {
+    spin(SPIN_USECS);
+    uthread_sem_post(&done);
+}
+
+void short_spinner(void) {
+    spin(SPIN_USECS / 4);
+    uthread_sem_post(&done);
+}
+
+void sleeper(void) {
+    uthread_sleep_usec(SPIN_USECS);
+    uthread_sem_post(&done);
+}
+
+void churn(void) {
+    uthread_sem_post(&done);
+}
+
+// Dumps the profile into a string; returns the dump's result
+int dump(char **text) {
+    size_t length;
+    FILE *stream = open_memstream(text, &length);
+    int result = uthread_profile_dump(stream);
+    fclose(stream);
+    return result;
+}
+
+// Samples on lines whose root frame is the given one ("uthread 3", "idle")
+int samples_of(const char *text, const char *root) {
+    int samples = 0;
+    size_t length = strlen(root);
+    for (const char *line = text; *line != '\0';) {
+        const char *end = strchr(line, '\n');
+        const char *count = end;
+        while (count > line && count[-1] != ' ') {
+            count--;
+        }
+        if (strncmp(line, root, length) == 0 && (line[length] == ';' || line[length] == ' ')) {
+            samples += atoi(count);
+        }
+        line = end + 1;
+    }
+    return samples;
+}
+
+// True if two lines of the dump have the same stack
+int has_duplicates(char *text) {
+    int num_lines = 0;
+    for (char *p = text; *p != '\0'; p++) {
+        num_lines += (*p == '\n');
+    }
+    char **lines = malloc(num_lines * sizeof(char *));
+    int n = 0;
+    for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        *strrchr(line, ' ') = '\0';
+        lines[n++] = line;
+    }
+    int duplicates = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            duplicates |= (strcmp(lines[i], lines[j]) == 0);
+        }
+    }
+    free(lines);
+    return duplicates;
+}
+
+int main() {
+    if (uthread_init(10000) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+    char *text;
+    if (uthread_profile_dump(stdout) != -1) {
+        fprintf(stderr, "Dumped a profile that was never started\n");
+        return 1;
+    }
+
+    if (uthread_profile_start(INTERVAL_USECS, 100000) == -1) {
+        fprintf(stderr, "uthread_profile_start failed\n");
+        return 1;
+    }
+    int long_tid = uthread_spawn(long_spinner);
+    int short_tid = uthread_spawn(short_spinner);
+    int sleeper_tid = uthread_spawn(sleeper);
+    for (int i = 0; i < 3; i++) {
+        uthread_sem_wait(&done);
+    }
+    // the main thread is sampled while the thread table grows under it
+    for (int i = 0; i < CHURN_THREADS; i++) {
+        uthread_spawn(churn);
+    }
+    for (int i = 0; i < CHURN_THREADS; i++) {
+        uthread_sem_wait(&done);
+    }
+    uthread_profile_stop();
+
+    if (dump(&text) != 0) {
+        fprintf(stderr, "Samples were dropped\n");
+        return 1;
+    }
+    char roots[3][32];
+    snprintf(roots[0], sizeof(roots[0]), "uthread %d", long_tid);
+    snprintf(roots[1], sizeof(roots[1]), "uthread %d", short_tid);
+    snprintf(roots[2], sizeof(roots[2]), "uthread %d", sleeper_tid);
+    int long_samples = samples_of(text, roots[0]);
+    int short_samples = samples_of(text, roots[1]);
+    int sleeper_samples = samples_of(text, roots[2]);
+    if (long_samples < 10 || short_samples < 2 || long_samples < short_samples * 2 || sleeper_samples > 2) {
+        fprintf(stderr, "Samples: %d for the long spinner, %d for the short one, %d for the sleeper\n",
+                long_samples, short_samples, sleeper_samples);
+        return 1;
+    }
+    if (has_duplicates(text)) {
+        fprintf(stderr, "Two lines of the profile have the same stack\n");
+        return 1;
+    }
+    free(text);
+
+    // a buffer too small for the run
+    uthread_profile_start(INTERVAL_USECS, 5);
+    uthread_spawn(long_spinner);
+    uthread_sem_wait(&done);
+    uthread_profile_stop();
+    int dropped = dump(&text);
+    if (dropped <= 0) {
+        fprintf(stderr, "A full buffer dropped %d samples\n", dropped);
+        return 1;
+    }
+    free(text);
+
+    printf("samples: %d long, %d short, %d sleeper; %d dropped\n", long_samples, short_samples, sleeper_samples,
+           dropped);
+    printf("Done!\n");
+    return 0;
+}
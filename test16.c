@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include "uthreads.h"
+
+// Shared-stack mode: threads keep their stack contents across switches, and channels, I/O on buffers in
+// the threads' stacks and offloaded calls all work, while an offload argument pointing into the shared
+// stack is rejected.
+
+#define THREADS 8
+#define ROUNDS 50
+#define ITEMS 1000
+#define MESSAGES 100
+
+uthread_chan_t work;
+uthread_sem_t done;
+int pipe_fds[2];
+int corrupted, received, echoed, offload_result, offload_error, offload_called;
+long item_sum;
+
+// Fills a stack array with its own pattern and checks it after every switch
+void keeper(void) {
+    int tid = uthread_get_tid();
+    char local[4096];
+    memset(local, tid, sizeof(local));
+    for (int i = 0; i < ROUNDS; i++) {
+        uthread_yield();
+        for (size_t k = 0; k < sizeof(local); k++) {
+            if (local[k] != (char)tid) {
+                corrupted++;
+                break;
+            }
+        }
+    }
+    uthread_sem_post(&done);
+}
+
+void producer(void) {
+    for (intptr_t i = 1; i <= ITEMS; i++) {
+        uthread_chan_send(&work, (void *)i);
+    }
+    uthread_sem_post(&done);
+}
+
+void consumer(void) {
+    for (int i = 0; i < ITEMS; i++) {
+        void *item;
+        uthread_chan_recv(&work, &item);
+        item_sum += (intptr_t)item;
+    }
+    uthread_sem_post(&done);
+}
+
+// Writes messages from a stack buffer; the reader parks on the empty pipe in between
+void writer(void) {
+    for (int i = 0; i < MESSAGES; i++) {
+        char message[32];
+        snprintf(message, sizeof(message), "message %03d", i);
+        uthread_write(pipe_fds[1], message, strlen(message));
+        uthread_yield();
+    }
+    close(pipe_fds[1]);
+    uthread_sem_post(&done);
+}
+
+void reader(void) {
+    char buffer[64];
+    int expected = 0;
+    ssize_t n;
+    while ((n = uthread_read(pipe_fds[0], buffer, 11)) == 11) {
+        char message[32];
+        snprintf(message, sizeof(message), "message %03d", expected++);
+        if (memcmp(buffer, message, 11) == 0) {
+            echoed++;
+        }
+    }
+    uthread_sem_post(&done);
+}
+
+void *add_one(void *arg) {
+    offload_called++;
+    return (void *)(intptr_t)(*(int *)arg + 1);
+}
+
+// One offloaded call with an argument in static memory, and one with an argument on the stack
+void offloader(void) {
+    static int value = 41;
+    offload_result = (int)(intptr_t)uthread_offload(add_one, &value);
+    int local = 41;
+    errno = 0;
+    if (uthread_offload(add_one, &local) == NULL) {
+        offload_error = errno;
+    }
+    uthread_sem_post(&done);
+}
+
+int main() {
+    uthread_init_attr_t attr = { .shared_stack = true };
+    if (uthread_init_ex(1000, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+    uthread_chan_init(&work, 0);
+    if (pipe(pipe_fds) == -1) {
+        fprintf(stderr, "pipe failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        uthread_spawn(keeper);
+    }
+    uthread_spawn(producer);
+    uthread_spawn(consumer);
+    uthread_spawn(reader);
+    uthread_spawn(writer);
+    uthread_spawn(offloader);
+    for (int i = 0; i < THREADS + 5; i++) {
+        uthread_sem_wait(&done);
+    }
+
+    if (corrupted != 0) {
+        fprintf(stderr, "%d threads found their stack changed\n", corrupted);
+        return 1;
+    }
+    if (item_sum != (long)ITEMS * (ITEMS + 1) / 2) {
+        fprintf(stderr, "Items summed to %ld\n", item_sum);
+        return 1;
+    }
+    if (echoed != MESSAGES) {
+        fprintf(stderr, "%d of %d messages came through the pipe\n", echoed, MESSAGES);
+        return 1;
+    }
+    if (offload_result != 42 || offload_error != EINVAL || offload_called != 1) {
+        fprintf(stderr, "Offload returned %d, then errno %d; fn ran %d times\n", offload_result, offload_error,
+                offload_called);
+        return 1;
+    }
+    printf("%d stacks kept, %d items, %d messages\n", THREADS, ITEMS, echoed);
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <signal.h>
+#include "uthreads.h"
+#include "test_fork.h"
+
+// Stack usage and adaptive stacks, in four configurations: stacks measured, stacks not measured, and
+// adaptive stacks, where an entry point that learned a shallow stack then overflows it into the guard page
+// (the child dies of SIGSEGV).
+
+#define HEAVY_BYTES (32 * 1024)
+#define DEEP_FRAMES 48
+
+uthread_sem_t done, release;
+int depth;
+
+// Keeps its stack in use until released
+void light(void) {
+    uthread_sem_post(&done);
+    uthread_sem_wait(&release);
+}
+
+void heavy(void) {
+    volatile char buffer[HEAVY_BYTES];
+    for (int i = 0; i < HEAVY_BYTES; i += 512) {
+        buffer[i] = 1;
+    }
+    uthread_sem_post(&done);
+    uthread_sem_wait(&release);
+    (void)buffer[0];
+}
+
+// About 1 KiB of stack per frame
+int recurse(int frames) {
+    volatile char frame[1024];
+    frame[0] = (char)frames;
+    if (frames == 0) {
+        return frame[0];
+    }
+    return recurse(frames - 1) + frame[0];
+}
+
+void recurser(void) {
+    recurse(depth);
+    uthread_sem_post(&done);
+}
+
+// Same, as an entry point of its own
+void other_recurser(void) {
+    recurse(depth);
+    uthread_sem_post(&done);
+}
+
+int measured(void) {
+    uthread_init_attr_t attr = { .measure_stacks = true };
+    if (uthread_init_ex(1000000, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+    uthread_sem_init(&release, 0);
+    int light_tid = uthread_spawn(light);
+    int heavy_tid = uthread_spawn(heavy);
+    uthread_sem_wait(&done);
+    uthread_sem_wait(&done);
+    ssize_t light_usage = uthread_get_stack_usage(light_tid);
+    ssize_t heavy_usage = uthread_get_stack_usage(heavy_tid);
+    if (light_usage <= 0 || light_usage > 16 * 1024 || heavy_usage < HEAVY_BYTES ||
+        heavy_usage > HEAVY_BYTES + 16 * 1024) {
+        fprintf(stderr, "Measured %zd and %zd bytes, expected a little and %d\n", light_usage, heavy_usage,
+                HEAVY_BYTES);
+        return 1;
+    }
+    if (uthread_get_stack_usage(0) != -1) {
+        fprintf(stderr, "Measured the main thread's stack\n");
+        return 1;
+    }
+    uthread_sem_post(&release);
+    uthread_sem_post(&release);
+    printf("measured: %zd and %zd bytes\n", light_usage, heavy_usage);
+    return 0;
+}
+
+int unmeasured(void) {
+    if (uthread_init(1000000) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+    uthread_sem_init(&release, 0);
+    int tid = uthread_spawn(light);
+    uthread_sem_wait(&done);
+    if (uthread_get_stack_usage(tid) != -1) {
+        fprintf(stderr, "Measured a stack without measure_stacks\n");
+        return 1;
+    }
+    uthread_sem_post(&release);
+    return 0;
+}
+
+// Deep runs fit where the library learned them, or was given a stack size
+int adaptive(void) {
+    uthread_init_attr_t attr = { .adaptive_stacks = true };
+    if (uthread_init_ex(1000000, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    // deep on a first spawn, which gets STACK_SIZE (the yield lets it terminate, which records its usage)
+    depth = DEEP_FRAMES;
+    uthread_spawn(recurser);
+    uthread_sem_wait(&done);
+    uthread_yield();
+    // the deep run is remembered: the same depth fits again
+    depth = DEEP_FRAMES;
+    uthread_spawn(recurser);
+    uthread_sem_wait(&done);
+    uthread_yield();
+
+    // an explicit stack_size is honored for an entry point that learned a shallow stack
+    depth = 0;
+    uthread_spawn(other_recurser);
+    uthread_sem_wait(&done);
+    uthread_yield();
+    depth = DEEP_FRAMES;
+    uthread_attr_t sized = { .stack_size = STACK_SIZE };
+    uthread_spawn_ex(other_recurser, &sized);
+    uthread_sem_wait(&done);
+    printf("adaptive: deep entry points and explicit stack sizes run deep\n");
+    return 0;
+}
+
+// An entry point only ever run shallow gets a small stack, which a deep run overflows
+int adaptive_overflow(void) {
+    uthread_init_attr_t attr = { .adaptive_stacks = true };
+    if (uthread_init_ex(1000000, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+    depth = 0;
+    uthread_spawn(recurser);
+    uthread_sem_wait(&done);
+    uthread_yield();
+    depth = DEEP_FRAMES;
+    uthread_spawn(recurser);
+    uthread_sem_wait(&done);
+    return 0;
+}
+
+int (*configurations[])(void) = { measured, unmeasured, adaptive, adaptive_overflow };
+
+int run(int configuration) {
+    return configurations[configuration]();
+}
+
+int main() {
+    // the last one must die in the guard page
+    int expected_signal[] = { 0, 0, 0, SIGSEGV };
+    for (int i = 0; i < 4; i++) {
+        if (run_in_child(run, i, expected_signal[i]) != 0) {
+            fprintf(stderr, "Configuration %d failed\n", i);
+            return 1;
+        }
+    }
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include "uthreads.h"
+
+// Quantum sleeps: sleepers wake in the order their sleeps end, a sleeper that is also blocked waits for
+// uthread_resume, and a terminated sleeper leaves the sleep heap. The quantum is long, so quantums only
+// pass when the main thread yields.
+
+#define SLEEPERS 5
+#define LONG_SLEEP 1000
+
+int lengths[SLEEPERS] = { 10, 2, 6, 4, 8 };
+int woken[SLEEPERS], woken_count;
+volatile int blocked_woke, waiter_woke;
+uthread_sem_t never;
+
+void sleeper(void) {
+    int index = uthread_get_tid() - 1;
+    uthread_sleep(lengths[index]);
+    woken[woken_count++] = lengths[index];
+}
+
+void blocked_sleeper(void) {
+    uthread_sleep(3);
+    blocked_woke = 1;
+}
+
+void long_sleeper(void) {
+    uthread_sleep(LONG_SLEEP);
+}
+
+// Waits on a semaphore nobody posts: only a stale sleep heap entry could wake it
+void waiter(void) {
+    uthread_sem_wait(&never);
+    waiter_woke = 1;
+}
+
+void yield_times(int count) {
+    for (int i = 0; i < count; i++) {
+        uthread_yield();
+    }
+}
+
+int main() {
+    if (uthread_init(1000000) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&never, 0);
+    if (uthread_sleep(1) != -1) {
+        fprintf(stderr, "The main thread slept\n");
+        return 1;
+    }
+
+    // tids 1..SLEEPERS all start sleeping in the same quantum
+    for (int i = 0; i < SLEEPERS; i++) {
+        uthread_spawn(sleeper);
+    }
+    while (woken_count < SLEEPERS) {
+        uthread_yield();
+    }
+    for (int i = 1; i < SLEEPERS; i++) {
+        if (woken[i] < woken[i - 1]) {
+            fprintf(stderr, "A sleep of %d quantums ended after one of %d\n", woken[i - 1], woken[i]);
+            return 1;
+        }
+    }
+
+    // blocked while asleep: the sleep ends, but the thread waits for uthread_resume
+    int tid = uthread_spawn(blocked_sleeper);
+    uthread_yield();
+    uthread_block(tid);
+    yield_times(10);
+    if (blocked_woke) {
+        fprintf(stderr, "A blocked sleeper ran without uthread_resume\n");
+        return 1;
+    }
+    uthread_resume(tid);
+    yield_times(2);
+    if (!blocked_woke) {
+        fprintf(stderr, "A resumed sleeper did not run\n");
+        return 1;
+    }
+
+    // a terminated sleeper leaves the heap: its successor in the same slot is not woken when the sleep
+    // would have ended, and a later sleeper is unaffected
+    tid = uthread_spawn(long_sleeper);
+    uthread_yield();
+    uthread_terminate(tid);
+    if (uthread_spawn(waiter) != tid) {
+        fprintf(stderr, "The terminated sleeper's tid was not reused\n");
+        return 1;
+    }
+    yield_times(LONG_SLEEP + 10);
+    if (waiter_woke) {
+        fprintf(stderr, "The terminated sleeper's heap entry woke another thread\n");
+        return 1;
+    }
+    uthread_spawn(blocked_sleeper);
+    blocked_woke = 0;
+    yield_times(5);
+    if (!blocked_woke) {
+        fprintf(stderr, "A sleeper after the terminated one did not wake\n");
+        return 1;
+    }
+
+    printf("woken in order:");
+    for (int i = 0; i < SLEEPERS; i++) {
+        printf(" %d", woken[i]);
+    }
+    printf("\nDone!\n");
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include "uthreads.h"
+
+// Cooperative mode: with no timer, a thread that spins for many quantums of wall time is never
+// preempted, and threads that only yield to each other alternate in strict FIFO order.
+
+#define QUANTUM_USECS 1000
+#define SPIN_USECS 200000
+#define YIELDS 1000
+
+volatile int marker_ran;
+int spinner_quantums;
+long long spinner_switches;
+int order[2 * YIELDS];
+int order_length;
+int finished;
+uthread_sem_t done;
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void spinner(void) {
+    int start_quantums = uthread_get_total_quantums();
+    long long start = now_us();
+    while (now_us() - start < SPIN_USECS && !marker_ran);
+    spinner_quantums = uthread_get_total_quantums() - start_quantums;
+    uthread_stats_t stats;
+    if (uthread_get_stats(uthread_get_tid(), &stats) == 0) {
+        spinner_switches = stats.involuntary_switches;
+    }
+    uthread_sem_post(&done);
+}
+
+void marker(void) {
+    marker_ran = 1;
+    uthread_sem_post(&done);
+}
+
+void alternator(void) {
+    for (int i = 0; i < YIELDS; i++) {
+        order[order_length++] = uthread_get_tid();
+        uthread_yield();
+    }
+    if (++finished == 2) {
+        uthread_sem_post(&done);
+    }
+}
+
+int main() {
+    uthread_init_attr_t attr = { .cooperative = true };
+    if (uthread_init_ex(QUANTUM_USECS, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    // the spinner runs first and must keep the CPU until its time is up
+    uthread_spawn(spinner);
+    uthread_spawn(marker);
+    uthread_sem_wait(&done);
+    uthread_sem_wait(&done);
+    if (marker_ran != 1 || spinner_quantums != 0 || spinner_switches != 0) {
+        fprintf(stderr, "The spinner was preempted: %d quantums, %lld involuntary switches\n",
+                spinner_quantums, spinner_switches);
+        return 1;
+    }
+    // marker_ran is only set once the spinner gave up the CPU
+    printf("spinner kept the CPU for %d ms\n", SPIN_USECS / 1000);
+
+    // main waits on the semaphore, so the two alternators are the only READY threads
+    int first = uthread_spawn(alternator);
+    int second = uthread_spawn(alternator);
+    uthread_sem_wait(&done);
+    if (order_length != 2 * YIELDS) {
+        fprintf(stderr, "Expected %d turns, got %d\n", 2 * YIELDS, order_length);
+        return 1;
+    }
+    for (int i = 0; i < order_length; i++) {
+        int expected = (i % 2 == 0) ? first : second;
+        if (order[i] != expected) {
+            fprintf(stderr, "Turn %d went to thread %d instead of %d\n", i, order[i], expected);
+            return 1;
+        }
+    }
+    printf("%d turns alternated between threads %d and %d\n", order_length, first, second);
+    printf("Done!\n");
+    return 0;
+}
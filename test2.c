@@ -29,16 +29,29 @@ int main() {
 
     printf("Spawned thread with ID: %d\n", tid1);
 
-    // Manually call the thread function (simulating the scheduler)
-    schedule_next();
+    // Give the thread the CPU
+    uthread_yield();
+
+    // The thread returned, so it was already terminated and its tid reclaimed
+    if (uthread_terminate(tid1) != -1) {
+        fprintf(stderr, "Terminated a thread that already finished\n");
+        return 1;
+    }
+
+    // ...and the next spawn reuses it
+    int tid2 = uthread_spawn(thread_function);
+    if (tid2 != tid1) {
+        fprintf(stderr, "Finished thread's ID was not reused\n");
+        return 1;
+    }
 
     // Terminate the thread
-    if (uthread_terminate(tid1) == -1) {
+    if (uthread_terminate(tid2) == -1) {
         fprintf(stderr, "Failed to terminate thread\n");
         return 1;
     }
 
-    printf("Terminated thread with ID: %d\n", tid1);
+    printf("Terminated thread with ID: %d\n", tid2);
 
     return 0;
 }
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include "uthreads.h"
+#include "test_fork.h"
+
+// uthread_set_priority: levels 0 to MLFQ_LEVELS - 1 are accepted and anything else is rejected. Under
+// MLFQ the READY threads then run highest priority first, while round robin keeps them in spawn order.
+
+#define QUANTUM_USECS 1000000
+#define THREADS MLFQ_LEVELS
+
+int order[THREADS];
+int order_length;
+uthread_sem_t done;
+
+void runner(void) {
+    order[order_length++] = uthread_get_tid();
+    if (order_length == THREADS) {
+        uthread_sem_post(&done);
+    }
+}
+
+int run(int policy) {
+    const char *name = (policy == UTHREAD_SCHED_MLFQ) ? "mlfq" : "rr";
+    uthread_init_attr_t attr = { .policy = policy };
+    if (uthread_init_ex(QUANTUM_USECS, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    // spawned in order, given the priorities in reverse
+    int tids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        tids[i] = uthread_spawn(runner);
+    }
+    if (uthread_set_priority(tids[0], -1) != -1 || uthread_set_priority(tids[0], MLFQ_LEVELS) != -1 ||
+        uthread_set_priority(THREADS + 1, 0) != -1) {
+        fprintf(stderr, "%s: an invalid priority or tid was accepted\n", name);
+        return 1;
+    }
+    for (int i = 0; i < THREADS; i++) {
+        if (uthread_set_priority(tids[i], THREADS - 1 - i) == -1) {
+            fprintf(stderr, "%s: priority %d was rejected\n", name, THREADS - 1 - i);
+            return 1;
+        }
+    }
+
+    uthread_sem_wait(&done);
+    for (int i = 0; i < THREADS; i++) {
+        int expected = (policy == UTHREAD_SCHED_MLFQ) ? tids[THREADS - 1 - i] : tids[i];
+        if (order[i] != expected) {
+            fprintf(stderr, "%s: run %d went to thread %d instead of %d\n", name, i, order[i], expected);
+            return 1;
+        }
+    }
+    printf("%s: ran in order", name);
+    for (int i = 0; i < THREADS; i++) {
+        printf(" %d", order[i]);
+    }
+    printf("\n");
+    return 0;
+}
+
+int main() {
+    int configurations[] = { UTHREAD_SCHED_MLFQ, UTHREAD_SCHED_RR };
+    for (int i = 0; i < 2; i++) {
+        if (run_in_child(run, configurations[i], 0) != 0) {
+            fprintf(stderr, "Failed under %s\n", (configurations[i] == UTHREAD_SCHED_MLFQ) ? "mlfq" : "rr");
+            return 1;
+        }
+    }
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include "uthreads.h"
+#include "test_fork.h"
+
+// The fair policy and custom policies. Under the fair policy spinners of weights 1024, 2048 and 4096 get
+// CPU time in proportion 1:2:4, and uthread_set_weight rejects non-positive weights and unknown tids. A
+// custom ops table decides the dispatch order: a LIFO table runs the last thread made READY first, which
+// the built-in policies never do.
+
+#define QUANTUM_USECS 4000
+#define SPIN_USECS 1000000
+#define SPINNERS 3
+#define RUNNERS 4
+#define TOLERANCE 0.25
+
+volatile int stop;
+long long run_ns[SPINNERS];
+int spinners_done;
+int order[RUNNERS];
+int order_length;
+uthread_sem_t done;
+
+void spinner(void) {
+    while (!stop);
+    uthread_stats_t stats;
+    if (uthread_get_stats(uthread_get_tid(), &stats) == 0) {
+        run_ns[uthread_get_tid() - 1] = stats.run_ns;
+    }
+    if (++spinners_done == SPINNERS) {
+        uthread_sem_post(&done);
+    }
+}
+
+// ends the measurement after a fixed wall time (main can't sleep)
+void controller(void) {
+    uthread_sleep_usec(SPIN_USECS);
+    stop = 1;
+}
+
+int run_fair(void) {
+    uthread_init_attr_t attr = { .policy = UTHREAD_SCHED_FAIR };
+    if (uthread_init_ex(QUANTUM_USECS, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    int tids[SPINNERS];
+    for (int i = 0; i < SPINNERS; i++) {
+        tids[i] = uthread_spawn(spinner);
+    }
+    if (uthread_set_weight(tids[0], 0) != -1 || uthread_set_weight(tids[0], -FAIR_DEFAULT_WEIGHT) != -1 ||
+        uthread_set_weight(SPINNERS + 2, FAIR_DEFAULT_WEIGHT) != -1) {
+        fprintf(stderr, "fair: an invalid weight or tid was accepted\n");
+        return 1;
+    }
+    for (int i = 0; i < SPINNERS; i++) {
+        if (uthread_set_weight(tids[i], FAIR_DEFAULT_WEIGHT << i) == -1) {
+            fprintf(stderr, "fair: weight %d was rejected\n", FAIR_DEFAULT_WEIGHT << i);
+            return 1;
+        }
+    }
+    uthread_spawn(controller);
+    uthread_sem_wait(&done);
+
+    // each spinner against the lightest one: 2x and 4x its CPU time
+    for (int i = 1; i < SPINNERS; i++) {
+        double ratio = (double)run_ns[i] / run_ns[0];
+        double expected = 1 << i;
+        if (run_ns[0] == 0 || ratio < expected * (1 - TOLERANCE) || ratio > expected * (1 + TOLERANCE)) {
+            fprintf(stderr, "fair: weight %d ran %lld ms against %lld ms at weight %d\n",
+                    FAIR_DEFAULT_WEIGHT << i, run_ns[i] / 1000000, run_ns[0] / 1000000, FAIR_DEFAULT_WEIGHT);
+            return 1;
+        }
+    }
+    printf("fair: ran %lld, %lld and %lld ms\n", run_ns[0] / 1000000, run_ns[1] / 1000000, run_ns[2] / 1000000);
+    return 0;
+}
+
+// A LIFO policy for a single worker: the thread made READY last runs first
+#define LIFO_CAPACITY 16
+thread_t *lifo[LIFO_CAPACITY];
+int lifo_size;
+int lifo_picks;
+
+void lifo_enqueue(int worker, thread_t *thread, bool next) {
+    (void)worker;
+    (void)next;
+    lifo[lifo_size++] = thread;
+}
+
+void lifo_dequeue(thread_t *thread) {
+    for (int i = 0; i < lifo_size; i++) {
+        if (lifo[i] == thread) {
+            lifo[i] = lifo[--lifo_size];
+            return;
+        }
+    }
+}
+
+thread_t *lifo_pick_next(int worker) {
+    (void)worker;
+    lifo_picks++;
+    return (lifo_size > 0) ? lifo[--lifo_size] : NULL;
+}
+
+bool lifo_has_ready(int worker) {
+    (void)worker;
+    return lifo_size > 0;
+}
+
+const uthread_sched_ops_t lifo_ops = { lifo_enqueue, lifo_dequeue, lifo_pick_next, lifo_has_ready, NULL, NULL };
+
+void runner(void) {
+    order[order_length++] = uthread_get_tid();
+    if (order_length == RUNNERS) {
+        uthread_sem_post(&done);
+    }
+}
+
+int run_custom(void) {
+    // overrides the policy
+    uthread_init_attr_t attr = { .policy = UTHREAD_SCHED_MLFQ, .sched_ops = &lifo_ops };
+    if (uthread_init_ex(QUANTUM_USECS, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    int tids[RUNNERS];
+    for (int i = 0; i < RUNNERS; i++) {
+        tids[i] = uthread_spawn(runner);
+    }
+    uthread_sem_wait(&done);
+    for (int i = 0; i < RUNNERS; i++) {
+        if (order[i] != tids[RUNNERS - 1 - i]) {
+            fprintf(stderr, "custom: run %d went to thread %d instead of %d\n", i, order[i], tids[RUNNERS - 1 - i]);
+            return 1;
+        }
+    }
+    if (lifo_picks < RUNNERS) {
+        fprintf(stderr, "custom: pick_next was called %d times\n", lifo_picks);
+        return 1;
+    }
+    printf("custom: ran in order %d %d %d %d\n", order[0], order[1], order[2], order[3]);
+    return 0;
+}
+
+int (*configurations[])(void) = { run_fair, run_custom };
+
+int run(int configuration) {
+    return configurations[configuration]();
+}
+
+int main() {
+    for (int i = 0; i < 2; i++) {
+        if (run_in_child(run, i, 0) != 0) {
+            fprintf(stderr, "Configuration %d failed\n", i);
+            return 1;
+        }
+    }
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <sys/resource.h>
+#include "uthreads.h"
+
+#define CYCLES 1000000
+
+int finished = 0;
+
+// A thread that returns right away, so it terminates itself
+void short_lived(void) {
+    finished++;
+}
+
+// A thread that never finishes on its own
+void long_lived(void) {
+    while (1);
+}
+
+long max_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+int main() {
+    if (uthread_init(1000000) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+
+    // Warm up the stack pool and the thread table before measuring
+    for (int i = 0; i < 1000; i++) {
+        uthread_spawn(short_lived);
+        uthread_yield();
+    }
+    long rss_before = max_rss_kb();
+
+    for (int i = 0; i < CYCLES; i++) {
+        // Self-termination: the thread exits on its own stack and is reaped after the switch
+        int tid = uthread_spawn(short_lived);
+        if (tid != 1) {
+            fprintf(stderr, "Cycle %d: self-terminated thread was not recycled (got tid %d)\n", i, tid);
+            return 1;
+        }
+        uthread_yield();
+
+        // Termination by another thread
+        tid = uthread_spawn(long_lived);
+        if (tid != 1) {
+            fprintf(stderr, "Cycle %d: terminated thread was not recycled (got tid %d)\n", i, tid);
+            return 1;
+        }
+        if (uthread_terminate(tid) == -1) {
+            fprintf(stderr, "Cycle %d: failed to terminate thread\n", i);
+            return 1;
+        }
+    }
+
+    long rss_after = max_rss_kb();
+    printf("%d threads finished, max RSS %ld KB before, %ld KB after\n", finished, rss_before, rss_after);
+    if (finished != CYCLES + 1000) {
+        fprintf(stderr, "Only %d threads ran to completion\n", finished);
+        return 1;
+    }
+    if (rss_after - rss_before > 1024) {
+        fprintf(stderr, "Memory footprint grew by %ld KB\n", rss_after - rss_before);
+        return 1;
+    }
+
+    printf("Done!\n");
+    return 0;
+}
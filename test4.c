@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include "uthreads.h"
+
+// M:N scheduling: spinners run on their own workers while the main thread blocks, resumes and
+// terminates them from worker 0. Doing so kicks the spinner's worker, which must not count as a quantum.
+
+#define NUM_WORKERS 4
+#define NUM_SPINNERS (NUM_WORKERS - 1)
+#define QUANTUM_USECS 10000000
+
+volatile long progress[NUM_SPINNERS + 1];
+
+void spinner(void) {
+    int tid = uthread_get_tid();
+    while (1) {
+        progress[tid]++;
+    }
+}
+
+// Waits until the thread has made some progress on its worker
+int wait_for_progress(int tid) {
+    long start = progress[tid];
+    for (long i = 0; i < 2000000000L; i++) {
+        if (progress[tid] - start > 1000) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    uthread_init_attr_t attr = { .num_workers = NUM_WORKERS };
+    if (uthread_init_ex(QUANTUM_USECS, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+
+    // no thread ever yields: the spinners only run if other workers picked them up
+    for (int i = 1; i <= NUM_SPINNERS; i++) {
+        if (uthread_spawn(spinner) != i) {
+            fprintf(stderr, "Failed to spawn thread %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 1; i <= NUM_SPINNERS; i++) {
+        if (!wait_for_progress(i)) {
+            fprintf(stderr, "Thread %d never ran on another worker\n", i);
+            return 1;
+        }
+    }
+    int total_before = uthread_get_total_quantums();
+
+    // blocking a thread running on another worker stops it there
+    if (uthread_block(1) == -1) {
+        fprintf(stderr, "Failed to block thread 1\n");
+        return 1;
+    }
+    long stopped_at = progress[1];
+    wait_for_progress(2);
+    if (progress[1] - stopped_at > 1000) {
+        fprintf(stderr, "Blocked thread 1 kept running\n");
+        return 1;
+    }
+    if (uthread_resume(1) == -1 || !wait_for_progress(1)) {
+        fprintf(stderr, "Resumed thread 1 does not run\n");
+        return 1;
+    }
+    // still in its first quantum
+    if (uthread_get_quantums(1) != 1) {
+        fprintf(stderr, "Blocking thread 1 counted as a quantum (%d)\n", uthread_get_quantums(1));
+        return 1;
+    }
+
+    // terminating threads running on other workers
+    for (int i = 1; i <= NUM_SPINNERS; i++) {
+        if (uthread_terminate(i) == -1) {
+            fprintf(stderr, "Failed to terminate thread %d\n", i);
+            return 1;
+        }
+    }
+    long final[NUM_SPINNERS + 1];
+    for (int i = 1; i <= NUM_SPINNERS; i++) {
+        final[i] = progress[i];
+    }
+    for (volatile long i = 0; i < 100000000L; i++);
+    for (int i = 1; i <= NUM_SPINNERS; i++) {
+        if (progress[i] - final[i] > 1000) {
+            fprintf(stderr, "Terminated thread %d kept running\n", i);
+            return 1;
+        }
+    }
+
+    // kicks are not quantums
+    if (uthread_get_total_quantums() != total_before) {
+        fprintf(stderr, "Kicks counted as %d quantums\n", uthread_get_total_quantums() - total_before);
+        return 1;
+    }
+
+    // the terminated threads are reaped on their workers, so their tids come back
+    int tid = uthread_spawn(spinner);
+    if (tid < 1 || tid > NUM_SPINNERS) {
+        fprintf(stderr, "Terminated threads were not recycled (got tid %d)\n", tid);
+        return 1;
+    }
+
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include "uthreads.h"
+#include "test_fork.h"
+
+// Mutexes, condition variables and semaphores, with one worker and with several (M:N).
+
+#define INCREMENTERS 4
+#define INCREMENTS 20000
+#define ITEMS 1000
+#define CONSUMERS 2
+#define WAITERS 5
+#define LIMITED 6
+#define LIMIT 2
+
+uthread_mutex_t lock;
+uthread_cond_t not_empty, not_full, go;
+uthread_sem_t done, slots;
+volatile long counter;
+int buffer_count, consumed, started, released, in_section, max_in_section;
+
+// Read-modify-write with a delay in between: lost updates show up unless the mutex works
+void incrementer(void) {
+    for (int i = 0; i < INCREMENTS; i++) {
+        uthread_mutex_lock(&lock);
+        long value = counter;
+        for (volatile int k = 0; k < 20; k++);
+        counter = value + 1;
+        uthread_mutex_unlock(&lock);
+    }
+    uthread_sem_post(&done);
+}
+
+// Bounded buffer of 10 items on a mutex and two condition variables
+void producer(void) {
+    for (int i = 0; i < ITEMS; i++) {
+        uthread_mutex_lock(&lock);
+        while (buffer_count == 10) {
+            uthread_cond_wait(&not_full, &lock);
+        }
+        buffer_count++;
+        uthread_cond_signal(&not_empty);
+        uthread_mutex_unlock(&lock);
+    }
+    uthread_sem_post(&done);
+}
+
+void consumer(void) {
+    for (int i = 0; i < ITEMS / CONSUMERS; i++) {
+        uthread_mutex_lock(&lock);
+        while (buffer_count == 0) {
+            uthread_cond_wait(&not_empty, &lock);
+        }
+        buffer_count--;
+        consumed++;
+        uthread_cond_signal(&not_full);
+        uthread_mutex_unlock(&lock);
+    }
+    uthread_sem_post(&done);
+}
+
+// Waits for the broadcast
+void waiter(void) {
+    uthread_mutex_lock(&lock);
+    started++;
+    while (!released) {
+        uthread_cond_wait(&go, &lock);
+    }
+    uthread_mutex_unlock(&lock);
+    uthread_sem_post(&done);
+}
+
+// At most LIMIT of these are between sem_wait and sem_post at once
+void limited(void) {
+    for (int i = 0; i < 100; i++) {
+        uthread_sem_wait(&slots);
+        uthread_mutex_lock(&lock);
+        in_section++;
+        if (in_section > max_in_section) {
+            max_in_section = in_section;
+        }
+        uthread_mutex_unlock(&lock);
+        uthread_yield();
+        uthread_mutex_lock(&lock);
+        in_section--;
+        uthread_mutex_unlock(&lock);
+        uthread_sem_post(&slots);
+    }
+    uthread_sem_post(&done);
+}
+
+void wait_done(int count) {
+    for (int i = 0; i < count; i++) {
+        uthread_sem_wait(&done);
+    }
+}
+
+int run(int num_workers) {
+    uthread_init_attr_t attr = { .num_workers = num_workers };
+    if (uthread_init_ex(1000, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_mutex_init(&lock);
+    uthread_cond_init(&not_empty);
+    uthread_cond_init(&not_full);
+    uthread_cond_init(&go);
+    uthread_sem_init(&done, 0);
+    uthread_sem_init(&slots, LIMIT);
+
+    // misuse is reported, not honored
+    uthread_mutex_lock(&lock);
+    if (uthread_mutex_lock(&lock) != -1) {
+        fprintf(stderr, "Locking a held mutex twice succeeded\n");
+        return 1;
+    }
+    uthread_mutex_unlock(&lock);
+    if (uthread_mutex_unlock(&lock) != -1) {
+        fprintf(stderr, "Unlocking an unlocked mutex succeeded\n");
+        return 1;
+    }
+
+    for (int i = 0; i < INCREMENTERS; i++) {
+        uthread_spawn(incrementer);
+    }
+    wait_done(INCREMENTERS);
+    if (counter != INCREMENTERS * INCREMENTS) {
+        fprintf(stderr, "%d workers: counter is %ld, expected %d\n", num_workers, counter, INCREMENTERS * INCREMENTS);
+        return 1;
+    }
+
+    // the mutex is free again, and trylock fails while it is held
+    if (uthread_mutex_trylock(&lock) != 0 || uthread_mutex_trylock(&lock) != -1) {
+        fprintf(stderr, "%d workers: trylock misbehaves\n", num_workers);
+        return 1;
+    }
+    uthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < CONSUMERS; i++) {
+        uthread_spawn(consumer);
+    }
+    uthread_spawn(producer);
+    wait_done(CONSUMERS + 1);
+    if (consumed != ITEMS || buffer_count != 0) {
+        fprintf(stderr, "%d workers: consumed %d items, %d left\n", num_workers, consumed, buffer_count);
+        return 1;
+    }
+
+    // a broadcast wakes every waiter
+    for (int i = 0; i < WAITERS; i++) {
+        uthread_spawn(waiter);
+    }
+    while (1) {
+        uthread_mutex_lock(&lock);
+        int all_waiting = (started == WAITERS);
+        if (all_waiting) {
+            released = 1;
+            uthread_cond_broadcast(&go);
+        }
+        uthread_mutex_unlock(&lock);
+        if (all_waiting) {
+            break;
+        }
+        uthread_yield();
+    }
+    wait_done(WAITERS);
+
+    for (int i = 0; i < LIMITED; i++) {
+        uthread_spawn(limited);
+    }
+    wait_done(LIMITED);
+    if (max_in_section > LIMIT || max_in_section == 0) {
+        fprintf(stderr, "%d workers: %d threads held a semaphore of %d\n", num_workers, max_in_section, LIMIT);
+        return 1;
+    }
+    if (uthread_sem_trywait(&slots) != 0 || uthread_sem_trywait(&slots) != 0 || uthread_sem_trywait(&slots) != -1) {
+        fprintf(stderr, "%d workers: sem_trywait misbehaves\n", num_workers);
+        return 1;
+    }
+
+    printf("%d workers: counter=%ld consumed=%d max_in_section=%d\n", num_workers, counter, consumed, max_in_section);
+    return 0;
+}
+
+int main() {
+    int configurations[] = { 1, 4 };
+    for (int i = 0; i < 2; i++) {
+        if (run_in_child(run, configurations[i], 0) != 0) {
+            fprintf(stderr, "Failed with %d workers\n", configurations[i]);
+            return 1;
+        }
+    }
+    printf("Done!\n");
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "uthreads.h"
+#include "test_fork.h"
+
+// Channels and select, with one worker and with several (M:N).
+
+#define PRODUCERS 3
+#define CONSUMERS 2
+#define ITEMS 2000
+#define SELECT_ITEMS 500
+
+uthread_chan_t work, results, left, right, quit;
+uthread_sem_t done;
+uthread_mutex_t totals = UTHREAD_MUTEX_INITIALIZER;
+long received_sum;
+int received_count;
+int out_of_order;
+
+// Items are (producer << 20) | sequence number, starting at 1 so that no item is NULL
+void producer(void) {
+    intptr_t id = uthread_get_tid();
+    for (intptr_t i = 1; i <= ITEMS; i++) {
+        uthread_chan_send(&work, (void *)((id << 20) | i));
+    }
+    uthread_sem_post(&done);
+}
+
+// Receives until it got its share, checking that each producer's items come in order
+void consumer(void) {
+    intptr_t last[64] = { 0 };
+    long sum = 0;
+    int count = 0, disorder = 0;
+    for (int i = 0; i < PRODUCERS * ITEMS / CONSUMERS; i++) {
+        void *item;
+        uthread_chan_recv(&work, &item);
+        intptr_t value = (intptr_t)item;
+        intptr_t id = value >> 20;
+        intptr_t sequence = value & ((1 << 20) - 1);
+        if (sequence <= last[id]) {
+            disorder++;
+        }
+        last[id] = sequence;
+        sum += sequence;
+        count++;
+    }
+    // consumers may run on different workers at the same time
+    uthread_mutex_lock(&totals);
+    received_sum += sum;
+    received_count += count;
+    out_of_order += disorder;
+    uthread_mutex_unlock(&totals);
+    uthread_sem_post(&done);
+}
+
+void left_sender(void) {
+    for (intptr_t i = 1; i <= SELECT_ITEMS; i++) {
+        uthread_chan_send(&left, (void *)i);
+    }
+    uthread_sem_post(&done);
+}
+
+void right_sender(void) {
+    for (intptr_t i = 1; i <= SELECT_ITEMS; i++) {
+        uthread_chan_send(&right, (void *)(i * 1000));
+    }
+    uthread_sem_post(&done);
+}
+
+// Receives from left and right until told to quit, and reports what it got on results
+void selector(void) {
+    intptr_t left_sum = 0, right_sum = 0;
+    while (1) {
+        uthread_chan_op_t ops[3] = {
+            { &left, UTHREAD_CHAN_RECV, NULL },
+            { &right, UTHREAD_CHAN_RECV, NULL },
+            { &quit, UTHREAD_CHAN_RECV, NULL },
+        };
+        int index = uthread_chan_select(ops, 3, true);
+        if (index == 0) {
+            left_sum += (intptr_t)ops[0].item;
+        } else if (index == 1) {
+            right_sum += (intptr_t)ops[1].item;
+        } else {
+            break;
+        }
+    }
+    // a select can send too
+    uthread_chan_op_t report = { &results, UTHREAD_CHAN_SEND, (void *)left_sum };
+    uthread_chan_select(&report, 1, true);
+    uthread_chan_send(&results, (void *)right_sum);
+}
+
+int run(int num_workers) {
+    uthread_init_attr_t attr = { .num_workers = num_workers };
+    if (uthread_init_ex(1000, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+    uthread_chan_init(&work, 8);
+    uthread_chan_init(&results, 0);
+    uthread_chan_init(&left, 0);
+    uthread_chan_init(&right, 4);
+    uthread_chan_init(&quit, 0);
+
+    // try operations never wait
+    void *item;
+    if (uthread_chan_tryrecv(&work, &item) != -1 || uthread_chan_trysend(&quit, (void *)1) != -1) {
+        fprintf(stderr, "%d workers: try operation succeeded with nobody on the other end\n", num_workers);
+        return 1;
+    }
+    for (intptr_t i = 1; i <= 4; i++) {
+        uthread_chan_trysend(&right, (void *)i);
+    }
+    if (uthread_chan_trysend(&right, (void *)5) != -1) {
+        fprintf(stderr, "%d workers: trysend to a full channel succeeded\n", num_workers);
+        return 1;
+    }
+    for (intptr_t i = 1; i <= 4; i++) {
+        if (uthread_chan_tryrecv(&right, &item) != 0 || (intptr_t)item != i) {
+            fprintf(stderr, "%d workers: buffered items came out of order\n", num_workers);
+            return 1;
+        }
+    }
+    uthread_chan_op_t idle_ops[2] = { { &left, UTHREAD_CHAN_RECV, NULL }, { &quit, UTHREAD_CHAN_SEND, NULL } };
+    if (uthread_chan_select(idle_ops, 2, false) != -1) {
+        fprintf(stderr, "%d workers: non-blocking select completed with nobody on the other end\n", num_workers);
+        return 1;
+    }
+
+    // producers and consumers on a buffered channel
+    for (int i = 0; i < CONSUMERS; i++) {
+        uthread_spawn(consumer);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        uthread_spawn(producer);
+    }
+    for (int i = 0; i < PRODUCERS + CONSUMERS; i++) {
+        uthread_sem_wait(&done);
+    }
+    long expected_sum = (long)PRODUCERS * ITEMS * (ITEMS + 1) / 2;
+    if (received_count != PRODUCERS * ITEMS || received_sum != expected_sum || out_of_order != 0) {
+        fprintf(stderr, "%d workers: received %d items summing to %ld (%d out of order)\n", num_workers,
+                received_count, received_sum, out_of_order);
+        return 1;
+    }
+
+    // one thread selecting over an unbuffered and a buffered channel
+    uthread_spawn(selector);
+    uthread_spawn(left_sender);
+    uthread_spawn(right_sender);
+    uthread_sem_wait(&done);
+    uthread_sem_wait(&done);
+    uthread_chan_send(&quit, NULL);
+    void *left_sum, *right_sum;
+    uthread_chan_recv(&results, &left_sum);
+    uthread_chan_recv(&results, &right_sum);
+    intptr_t expected = (intptr_t)SELECT_ITEMS * (SELECT_ITEMS + 1) / 2;
+    if ((intptr_t)left_sum != expected || (intptr_t)right_sum != expected * 1000) {
+        fprintf(stderr, "%d workers: select received %ld and %ld\n", num_workers, (long)(intptr_t)left_sum,
+                (long)(intptr_t)right_sum);
+        return 1;
+    }
+
+    printf("%d workers: %d items, select sums %ld and %ld\n", num_workers, received_count,
+           (long)(intptr_t)left_sum, (long)(intptr_t)right_sum);
+    return 0;
+}
+
+int main() {
+    int configurations[] = { 1, 4 };
+    for (int i = 0; i < 2; i++) {
+        if (run_in_child(run, configurations[i], 0) != 0) {
+            fprintf(stderr, "Failed with %d workers\n", configurations[i]);
+            return 1;
+        }
+    }
+    printf("Done!\n");
+    return 0;
+}
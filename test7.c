@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "uthreads.h"
+
+// The epoll-backed I/O wrappers: a thread waiting on an fd is parked, and the other threads keep running.
+
+#define BULK_BYTES (4 * 1024 * 1024)
+#define MESSAGES 100
+
+int pipe_fds[2], bulk_fds[2];
+int listen_fd;
+struct sockaddr_in server_addr;
+volatile long spins;
+volatile int reader_done, spinner_stop;
+long bulk_received;
+int echoed;
+uthread_sem_t done;
+
+// Runs while the others wait on their fds
+void spinner(void) {
+    while (!spinner_stop) {
+        spins++;
+        uthread_yield();
+    }
+    uthread_sem_post(&done);
+}
+
+// Reads from an empty pipe: parks until the main thread writes
+void reader(void) {
+    char buf[16];
+    ssize_t n = uthread_read(pipe_fds[0], buf, sizeof(buf));
+    reader_done = (n == 5 && memcmp(buf, "hello", 5) == 0) ? 1 : -1;
+    uthread_sem_post(&done);
+}
+
+// Writes far more than the pipe holds: parks on EPOLLOUT until the drain catches up
+void bulk_writer(void) {
+    static char chunk[65536];
+    long written = 0;
+    while (written < BULK_BYTES) {
+        // writes may be partial: never more than what is left
+        size_t length = BULK_BYTES - written < (long)sizeof(chunk) ? BULK_BYTES - written : sizeof(chunk);
+        ssize_t n = uthread_write(bulk_fds[1], chunk, length);
+        if (n == -1) {
+            break;
+        }
+        written += n;
+    }
+    close(bulk_fds[1]);
+    uthread_sem_post(&done);
+}
+
+void bulk_reader(void) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = uthread_read(bulk_fds[0], buf, sizeof(buf))) > 0) {
+        bulk_received += n;
+    }
+    uthread_sem_post(&done);
+}
+
+// Accepts one connection and echoes back every message
+void server(void) {
+    int fd = uthread_accept(listen_fd, NULL, NULL);
+    if (fd != -1) {
+        char buf[64];
+        ssize_t n;
+        while ((n = uthread_read(fd, buf, sizeof(buf))) > 0) {
+            uthread_write(fd, buf, n);
+        }
+        close(fd);
+    }
+    uthread_sem_post(&done);
+}
+
+void client(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1 && uthread_connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
+        for (int i = 0; i < MESSAGES; i++) {
+            char out[32], in[32];
+            int length = snprintf(out, sizeof(out), "message %d", i);
+            int got = 0;
+            uthread_write(fd, out, length);
+            while (got < length) {
+                ssize_t n = uthread_read(fd, in + got, length - got);
+                if (n <= 0) {
+                    break;
+                }
+                got += n;
+            }
+            if (got == length && memcmp(in, out, length) == 0) {
+                echoed++;
+            }
+        }
+    }
+    close(fd);
+    uthread_sem_post(&done);
+}
+
+int main() {
+    if (uthread_init(1000) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+    if (pipe(pipe_fds) == -1 || pipe(bulk_fds) == -1) {
+        fprintf(stderr, "pipe failed\n");
+        return 1;
+    }
+
+    // a parked reader doesn't hold up the spinner
+    uthread_spawn(reader);
+    uthread_spawn(spinner);
+    while (spins < 1000) {
+        uthread_yield();
+    }
+    if (reader_done != 0) {
+        fprintf(stderr, "Reader returned from an empty pipe\n");
+        return 1;
+    }
+    if (write(pipe_fds[1], "hello", 5) != 5) {
+        fprintf(stderr, "write failed\n");
+        return 1;
+    }
+    uthread_sem_wait(&done);
+    if (reader_done != 1) {
+        fprintf(stderr, "Reader got the wrong data\n");
+        return 1;
+    }
+
+    // a reader terminated while parked gives up its fd, and the next reader still gets the data
+    reader_done = 0;
+    int parked = uthread_spawn(reader);
+    long parked_spins = spins;
+    while (spins < parked_spins + 1000) {
+        uthread_yield();
+    }
+    if (reader_done != 0 || uthread_terminate(parked) == -1) {
+        fprintf(stderr, "Failed to terminate a parked reader\n");
+        return 1;
+    }
+    if (write(pipe_fds[1], "hello", 5) != 5) {
+        fprintf(stderr, "write failed\n");
+        return 1;
+    }
+    uthread_spawn(reader);
+    uthread_sem_wait(&done);
+    if (reader_done != 1) {
+        fprintf(stderr, "Reader after a terminated one got the wrong data\n");
+        return 1;
+    }
+
+    // a writer parked on a full pipe
+    uthread_spawn(bulk_writer);
+    uthread_spawn(bulk_reader);
+    uthread_sem_wait(&done);
+    uthread_sem_wait(&done);
+    if (bulk_received != BULK_BYTES) {
+        fprintf(stderr, "Received %ld of %d bytes through the pipe\n", bulk_received, BULK_BYTES);
+        return 1;
+    }
+
+    // accept, connect and an echo over TCP on the loopback interface
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    socklen_t length = sizeof(server_addr);
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = 0;
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+        listen(listen_fd, 1) == -1 || getsockname(listen_fd, (struct sockaddr *)&server_addr, &length) == -1) {
+        fprintf(stderr, "Failed to set up a listening socket\n");
+        return 1;
+    }
+    uthread_spawn(server);
+    uthread_spawn(client);
+    uthread_sem_wait(&done);
+    uthread_sem_wait(&done);
+    if (echoed != MESSAGES) {
+        fprintf(stderr, "Only %d of %d messages were echoed\n", echoed, MESSAGES);
+        return 1;
+    }
+
+    // errors come back like the system call's
+    char byte;
+    if (uthread_read(-1, &byte, 1) != -1 || errno != EBADF) {
+        fprintf(stderr, "Reading a bad fd did not fail with EBADF\n");
+        return 1;
+    }
+
+    spinner_stop = 1;
+    uthread_sem_wait(&done);
+    printf("spins=%ld bulk=%ld echoed=%d\n", spins, bulk_received, echoed);
+    printf("Done!\n");
+    return 0;
+}
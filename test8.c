@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "uthreads.h"
+
+// uthread_offload: blocking calls run on helper kernel threads while the uthreads keep running.
+
+#define CALLERS OFFLOAD_THREADS
+#define SLEEP_USECS 200000
+
+volatile long spins;
+volatile int spinner_stop;
+int results[CALLERS];
+int error_seen;
+uthread_sem_t done;
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Blocks its kernel thread, which must be a helper
+void *blocking_sleep(void *arg) {
+    usleep(SLEEP_USECS);
+    return arg;
+}
+
+void *failing_open(void *arg) {
+    return (void *)(long)open((const char *)arg, O_RDONLY);
+}
+
+void caller(void) {
+    int tid = uthread_get_tid();
+    results[tid - 1] = (int)(long)uthread_offload(blocking_sleep, (void *)(long)tid);
+    uthread_sem_post(&done);
+}
+
+void failing_caller(void) {
+    long fd = (long)uthread_offload(failing_open, "/nonexistent/file");
+    error_seen = (fd == -1) ? errno : 0;
+    uthread_sem_post(&done);
+}
+
+void spinner(void) {
+    while (!spinner_stop) {
+        spins++;
+        uthread_yield();
+    }
+    uthread_sem_post(&done);
+}
+
+int main() {
+    if (uthread_init(1000) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    // one call per helper: they overlap, and the spinner runs meanwhile
+    long long start = now_us();
+    for (int i = 0; i < CALLERS; i++) {
+        uthread_spawn(caller);
+    }
+    uthread_spawn(spinner);
+    for (int i = 0; i < CALLERS; i++) {
+        uthread_sem_wait(&done);
+    }
+    long long elapsed = now_us() - start;
+    for (int i = 0; i < CALLERS; i++) {
+        if (results[i] != i + 1) {
+            fprintf(stderr, "Caller %d got %d back\n", i + 1, results[i]);
+            return 1;
+        }
+    }
+    if (elapsed >= (long long)SLEEP_USECS * CALLERS) {
+        fprintf(stderr, "Offloaded calls ran one after the other (%lld us)\n", elapsed);
+        return 1;
+    }
+    if (spins < 100) {
+        fprintf(stderr, "The spinner barely ran while the calls blocked (%ld spins)\n", spins);
+        return 1;
+    }
+
+    // errno set by the call is the caller's errno
+    uthread_spawn(failing_caller);
+    uthread_sem_wait(&done);
+    if (error_seen != ENOENT) {
+        fprintf(stderr, "errno was %d, expected ENOENT\n", error_seen);
+        return 1;
+    }
+
+    // a caller terminated while its call runs: the call completes, and the helper is free again
+    int tid = uthread_spawn(caller);
+    uthread_yield();
+    if (uthread_terminate(tid) == -1) {
+        fprintf(stderr, "Failed to terminate a waiting caller\n");
+        return 1;
+    }
+    for (int i = 0; i < CALLERS; i++) {
+        uthread_spawn(caller);
+    }
+    for (int i = 0; i < CALLERS; i++) {
+        uthread_sem_wait(&done);
+    }
+
+    spinner_stop = 1;
+    uthread_sem_wait(&done);
+    printf("%d overlapping calls took %lld us, spins=%ld\n", CALLERS, elapsed, spins);
+    printf("Done!\n");
+    return 0;
+}
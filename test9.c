@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <limits.h>
+#include "uthreads.h"
+#include "test_fork.h"
+
+// Timed sleeps next to a thread that never yields: with a 100 ms quantum a 1 ms sleep must still take
+// about 1 ms, with the timer always running and in tickless mode. A sleep too long for a nanosecond
+// deadline must not wrap around into the past.
+
+#define QUANTUM_USECS 100000
+#define SLEEPS 20
+#define SLEEP_USECS 1000
+#define MAX_LATENCY_USECS 20000
+
+volatile int spinner_stop;
+volatile int far_sleeper_woke;
+long long max_latency;
+uthread_sem_t done;
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// CPU-bound: gives up the CPU only when preempted
+void spinner(void) {
+    while (!spinner_stop);
+    uthread_sem_post(&done);
+}
+
+void sleeper(void) {
+    for (int i = 0; i < SLEEPS; i++) {
+        long long start = now_us();
+        uthread_sleep_usec(SLEEP_USECS);
+        long long latency = now_us() - start - SLEEP_USECS;
+        if (latency > max_latency) {
+            max_latency = latency;
+        }
+    }
+    spinner_stop = 1;
+    uthread_sem_post(&done);
+}
+
+void far_sleeper(void) {
+    uthread_sleep_usec(LONG_MAX);
+    far_sleeper_woke = 1;
+}
+
+int run(int tickless) {
+    const char *mode = tickless ? "tickless" : "normal";
+    uthread_init_attr_t attr = { .tickless = tickless };
+    if (uthread_init_ex(QUANTUM_USECS, &attr) == -1) {
+        fprintf(stderr, "Failed to initialize uthreads\n");
+        return 1;
+    }
+    uthread_sem_init(&done, 0);
+
+    int far = uthread_spawn(far_sleeper);
+    uthread_spawn(spinner);
+    uthread_spawn(sleeper);
+    uthread_sem_wait(&done);
+    uthread_sem_wait(&done);
+    if (far_sleeper_woke || uthread_terminate(far) == -1) {
+        fprintf(stderr, "%s: a %ld us sleep ended early\n", mode, LONG_MAX);
+        return 1;
+    }
+    if (max_latency > MAX_LATENCY_USECS) {
+        fprintf(stderr, "%s: a %d us sleep overslept by %lld us\n", mode, SLEEP_USECS, max_latency);
+        return 1;
+    }
+    printf("%s: max oversleep %lld us\n", mode, max_latency);
+    return 0;
+}
+
+int main() {
+    int configurations[] = { false, true };
+    for (int i = 0; i < 2; i++) {
+        if (run_in_child(run, configurations[i], 0) != 0) {
+            fprintf(stderr, "Failed in %s mode\n", configurations[i] ? "tickless" : "normal");
+            return 1;
+        }
+    }
+    printf("Done!\n");
+    return 0;
+}
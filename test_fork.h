@@ -0,0 +1,28 @@
+#ifndef TEST_FORK_H
+#define TEST_FORK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+// The library can be initialized only once per process, so a test that tries several configurations
+// runs each one in a forked child. Returns 0 if run(arg) exited the child with 0 or, when expected_signal
+// is not 0, if that signal killed the child; -1 otherwise.
+static int run_in_child(int (*run)(int), int arg, int expected_signal) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        exit(run(arg));
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (expected_signal != 0) {
+        return (WIFSIGNALED(status) && WTERMSIG(status) == expected_signal) ? 0 : -1;
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+#endif
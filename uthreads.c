@@ -7,7 +7,25 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/auxv.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
 #include "uthreads.h"
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 #ifdef __x86_64__
 #define JB_SP 6
 #define JB_PC 7
@@ -15,405 +33,4451 @@
 #error "Unsupported architecture"
 #endif
 typedef unsigned long address_t;
-static sigset_t sigvtalrm_set;
 
-thread_t threads[MAX_THREAD_NUM];
-char stacks[MAX_THREAD_NUM][STACK_SIZE];
-int current_thread_id = 0;
+#ifdef UTHREAD_SWITCH_ASM
+/*
+ * switch_stacks(save_sp, load_sp): pushes the callee-saved registers and the MXCSR/x87 control words
+ * on the current stack, stores the stack pointer in *save_sp, then pops the same frame from load_sp.
+ * No signal mask is touched, so a switch makes no system call.
+ */
+void switch_stacks(void **save_sp, void *load_sp);
+asm(".text\n"
+    ".globl switch_stacks\n"
+    ".hidden switch_stacks\n"
+    ".type switch_stacks, @function\n"
+    "switch_stacks:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $16, %rsp\n"
+    "    stmxcsr 8(%rsp)\n"
+    "    fnstcw (%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    fldcw (%rsp)\n"
+    "    ldmxcsr 8(%rsp)\n"
+    "    addq $16, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size switch_stacks, .-switch_stacks\n");
+
+/** Initial switch frame, laid out exactly as switch_stacks pushes it (lowest address first). */
+typedef struct {
+    unsigned short fpu_cw;
+    unsigned short pad[3];
+    unsigned int mxcsr;
+    unsigned int pad2;
+    address_t r15, r14, r13, r12, rbx, rbp;
+    address_t ret;      // where the first switch "returns" to
+    address_t fake_ret; // return address seen by the entry function (never used)
+} switch_frame_t;
+#endif
+
+// Thread table: TCBs are allocated once per tid and kept for reuse, only the pointer array grows
+static thread_t **threads = NULL;
+static int thread_capacity = 0;   // allocated length of threads[], the sleep heaps and free_tids[]
+static int thread_table_size = 0; // tids [0, thread_table_size) have a TCB; the next fresh tid
+static int *free_tids = NULL;     // min-heap of released tids below thread_table_size
+static int free_tid_count = 0;
 static int total_quantums = 0;
 
+// Min-heaps of threads; a thread is in at most one of them at a time, at position heap_index
+typedef struct {
+    thread_t **entries;
+    int size;
+    long long (*key)(thread_t *thread);
+} thread_heap_t;
+static long long quantum_key(thread_t *thread);
+static long long deadline_key(thread_t *thread);
+static long long vruntime_key(thread_t *thread);
+// Sleeping threads: those sleeping for quantums (keyed on sleep_until), and those sleeping until a
+// CLOCK_MONOTONIC deadline (keyed on sleep_deadline)
+static thread_heap_t sleep_heap = { NULL, 0, quantum_key };
+static thread_heap_t deadline_heap = { NULL, 0, deadline_key };
+// One-shot timer at the earliest deadline (preemptive modes only): it kicks worker 0, so a timed sleeper
+// wakes on time even while other threads run
+static timer_t deadline_timer;
+static bool deadline_timer_created = false;
+static long long deadline_armed = 0; // deadline the timer is armed for (0 while disarmed)
+
+// A kernel thread running uthreads. Worker 0 is the thread that called uthread_init; any others
+// are pthreads that start out idle and steal READY threads from the busy workers' queues.
+typedef struct {
+    int index;
+    thread_t *current;                     // thread running on this worker (&idle if nothing is runnable)
+    thread_t idle;                         // idle context of this worker (not in the thread table)
+    thread_queue_t run_queue[MLFQ_LEVELS]; // READY threads queued on this worker, by level
+    volatile sig_atomic_t resched_pending; // a tick arrived while the current thread was in a critical section
+    volatile sig_atomic_t kick_pending;    // a kick arrived while the current thread was in a critical section
+    int zombie_tid;                        // thread that terminated on this worker; reaped after the switch away
+    pthread_t pthread;
+    timer_t timer;                         // quantum timer on this worker's CPU time
+    int timer_usecs;                       // period the timer is armed with (0 while disarmed, -1 to have it reprogrammed)
+    long long switch_ticks;                // stats clock at the switch in progress (read once for policy and stats)
+    thread_t *fair_next;                   // fair policy: thread to run at this worker's next switch, ahead of the heap
+    bool preempting;                       // the switch in progress is a timer preemption
+    bool ticking;                          // the switch in progress is a timer tick, so the timer period just began
+    long long switches;                    // statistics: context switches of this worker
+    long long ticks_taken;                 // statistics: timer ticks handled right away
+    volatile long long ticks_deferred;     // statistics: timer ticks deferred to the end of a critical section
+    pid_t kernel_tid;                      // kernel thread id, for timers that signal this worker
+    timer_t profile_timer;                 // profiler: SIGPROF timer on this worker's CPU time
+    char *pthread_stack;                   // profiler: lowest address of the kernel thread's own stack
+    size_t pthread_stack_size;             // profiler: size of the kernel thread's own stack
+    ucontext_t *tick_context;              // profiler: code a tick interrupted, while the tick takes a held-back sample
+} worker_t;
+
+static worker_t *workers = NULL;
+static int num_workers = 1;
+static int quantum_length = 0; // quantum in microseconds
+static bool preemptive = true;  // false: no timer, threads switch only when they give up the CPU
+static bool tickless = false;   // disarm a worker's timer while nobody could preempt its thread
+static const uthread_sched_ops_t rr_ops, mlfq_ops, fair_ops;
+static const uthread_sched_ops_t *sched = &rr_ops; // scheduling policy
+static int boost_epoch = 0;     // MLFQ boosts so far; threads from an older epoch get their priority level back
+static int next_boost = 0;      // total_quantums at which the next MLFQ boost is due
+static thread_heap_t fair_heap = { NULL, 0, vruntime_key }; // fair policy: READY threads of all workers
+static long long fair_min_vruntime = 0; // fair policy: vruntime of the last thread picked (never decreases)
+static long long init_ns = 0;   // CLOCK_MONOTONIC time of uthread_init
+static long long init_ticks = 0; // stats clock time of uthread_init
+#define STATS_RESCALE_TICKS (1LL << 26) // about 20 ms of time stamp counter at a few GHz
+static long double stats_scale = 0;     // ns per stats clock tick, for conversions on the switch path
+static long long stats_scale_ticks = 0; // stats clock time stats_scale was measured at
+
+// Scheduler events recorded while tracing is on
+typedef enum {
+    TRACE_SPAWN,
+    TRACE_SWITCH,
+    TRACE_BLOCK,
+    TRACE_RESUME,
+    TRACE_SLEEP,
+    TRACE_WAKE,
+    TRACE_TERMINATE,
+    TRACE_TICK
+} trace_type_t;
+
+#define TRACE_PREEMPTED 1  // switch: the timer cut prev's quantum / tick: it was deferred by a critical section
+#define TRACE_PREV_READY 2 // switch: prev stays READY (preempted or yielded)
+
+typedef struct {
+    long long ticks;   // stats clock time
+    int tid;           // thread the event is about (-1 for an idle context)
+    int arg;           // switch: next thread; spawn, block, resume, terminate: calling thread; sleep: length
+    short type;        // trace_type_t
+    short worker;      // worker that recorded the event
+    int flags;         // TRACE_* flags
+} trace_event_t;
+
+static trace_event_t *trace_buffer = NULL;
+static unsigned long long trace_capacity = 0; // power of two
+static unsigned long long trace_next = 0;     // events recorded since uthread_trace_start (slot is mod capacity)
+static volatile bool tracing = false;
+
+// Profiler samples: the thread that was running and its call stack, innermost frame first
+typedef struct {
+    int tid;           // -1 for an idle context
+    int depth;
+    void *frames[PROFILE_MAX_DEPTH];
+} profile_sample_t;
+
+// A line of the profile dump: a symbolized stack and its number of samples
+typedef struct {
+    char *line;
+    int count;
+} profile_line_t;
+
+static profile_sample_t *profile_samples = NULL;
+static int profile_capacity = 0;
+static int profile_count = 0;   // samples taken, including the ones dropped once the buffer was full
+static volatile bool profiling = false;
+static int profile_in_flight = 0;            // profiler handlers running right now (a dump waits for them)
+static volatile bool profile_holds_ticks = false; // ticks hold SIGPROF back (see install_tick_handler)
+static __thread worker_t *current_worker = NULL;
+
+// With more than one worker, all library state is protected by this spinlock. It is taken by the
+// outermost critical section and handed over across context switches together with the CPU.
+static volatile int sched_lock = 0;
+
+// Another worker kicks a worker whose running thread it blocked or terminated, and the deadline timer kicks
+// worker 0 when a timed sleeper is due. Kicks have a signal of their own, so they are never mistaken for a
+// timer tick (SIGURG is ignored by default, so a stray one is harmless).
+#define KICK_SIGNAL SIGURG
+
+static void quantum_expired(bool preempted);
+static void kicked();
+static void kick_handler(int signum);
+static void install_tick_handler(bool hold_samples);
+static void run_next(worker_t *worker, thread_t *prev, thread_t *next);
+static void update_timer(worker_t *worker);
+static long long monotonic_ns();
+static long long stats_clock();
+static void trace(trace_type_t type, int tid, int arg, int flags);
+
+// I/O: one epoll instance for the process; threads waiting on an fd are queued in its record
+typedef struct {
+    thread_queue_t readers;     // threads waiting for the fd to become readable
+    thread_queue_t writers;     // threads waiting for the fd to become writable
+    bool armed;                 // registered with epoll and not reported yet
+} io_fd_t;
+static int epoll_fd = -1;
+static io_fd_t **io_fds = NULL;  // records indexed by fd, allocated on first wait and kept
+static int io_fds_capacity = 0;
+static int io_armed = 0;         // fds armed in epoll; the scheduler only polls while nonzero
+
+// Idle workers block in epoll; wake_fd (edge-triggered in the same epoll) wakes one of them up
+static int wake_fd = -1;
+static int idle_waiting = 0;     // workers blocked (or about to block) in idle_wait
+static bool idle_kicked = false; // wake_fd was written and not drained yet
+
+// Offload: calls queued for the helper pthreads, and the calls they finished (lock-free stack)
+typedef struct offload_job {
+    uthread_offload_fn fn;
+    void *arg;
+    void *result;
+    int error;                  // errno left by fn
+    thread_t *thread;           // waiting thread (NULL once it was terminated)
+    struct offload_job *next;
+} offload_job_t;
+static pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offload_cond = PTHREAD_COND_INITIALIZER;
+static offload_job_t *offload_head = NULL; // submitted calls, oldest first (under offload_lock)
+static offload_job_t *offload_tail = NULL;
+static offload_job_t *offload_done = NULL; // finished calls, pushed by the helpers
+static bool offload_started = false;
+static int offload_waiting = 0;            // threads waiting for an offloaded call (under the scheduler lock)
+
+// Pool of free stacks, one list per size class; the link lives at the bottom of the free stack itself
+typedef struct stack_block {
+    struct stack_block *next;
+} stack_block_t;
+static stack_block_t *stack_pool[STACK_POOL_CLASSES];
+static size_t page_size = 0;
+static size_t min_stack_size = MIN_STACK_SIZE; // large enough to take a signal frame plus the timer handler
+
+// Shared-stack mode: every spawned thread runs on one run stack. Its owner is the thread whose contents
+// are on it; the others keep the used part of theirs in stack_copy. Swapping contents while the owner is
+// running on it is done by the stack copier, a context with a stack of its own.
+#define STACK_COPY_GRANULE 256          // stack copies are sized in multiples of this
+static char *shared_stack = NULL;
+static size_t shared_stack_size = 0;
+static thread_t *stack_owner = NULL;
+static thread_t stack_copier;
+static thread_t *copy_target = NULL;    // thread the copier swaps in and switches to
+
+// Stack measurement: spawned stacks are filled with a pattern, and the lowest word that no longer holds it
+// marks the deepest the thread has been. Adaptive stacks remember that depth per entry point, in a table
+// with open addressing on the entry point.
+#define STACK_FILL_BYTE 0xa5
+#define STACK_FILL_WORD 0xa5a5a5a5a5a5a5a5ULL
+typedef struct {
+    thread_entry_point entry;   // NULL for a free slot
+    size_t peak;                // deepest stack usage seen from a thread with this entry point
+} stack_profile_t;
+static bool measure_stacks = false;
+static bool adaptive_stacks = false;
+static stack_profile_t *stack_profiles = NULL;
+static size_t stack_profiles_capacity = 0; // a power of two (or 0)
+static size_t num_stack_profiles = 0;
+
 //--------------------------------------------------------------------------------------------------//
 
-static void enter_crit_sec()
+static __attribute__((noinline)) worker_t *this_worker()
 {
-    // block signals
-    if (sigprocmask(SIG_BLOCK, &sigvtalrm_set, NULL) < 0)
-    {
-        fprintf(stderr, "system error: failed to block signal\n");
-        exit(1);
-    }
+    // never cached across a call: the calling thread may resume on another worker after a switch
+    worker_t *worker = current_worker;
+    asm volatile("" : "+r"(worker));
+    return worker;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-static void exit_crit_sec()
+static void sched_lock_acquire()
 {
-    // ublock signals
-    if (sigprocmask(SIG_UNBLOCK, &sigvtalrm_set, NULL) < 0)
+    int spins = 0;
+    while (__atomic_exchange_n(&sched_lock, 1, __ATOMIC_ACQUIRE))
     {
-        fprintf(stderr, "system error: failed to unblock signal\n");
-        exit(1);
+        // the holder may have been descheduled by the kernel
+        if (++spins % 128 == 0)
+        {
+            sched_yield();
+        }
+        __builtin_ia32_pause();
     }
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-address_t translate_address(address_t addr)
+static void sched_lock_release()
 {
-    address_t ret;
-    asm volatile("xor %%fs:0x30, %0\n"
-                 "rol $0x11 , %0\n"
-
-                 : "=g"(ret)
-                 : "0"(addr));
-    return ret;
+    __atomic_store_n(&sched_lock, 0, __ATOMIC_RELEASE);
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_init(int quantum_usecs)
+static void enter_crit_sec()
 {
-    // initialize all threads as unused
-    for (int i = 0; i < MAX_THREAD_NUM; i++)
+    // nothing can preempt a cooperative single kernel thread
+    if (!preemptive && num_workers == 1)
     {
-        threads[i].state = THREAD_UNUSED;
+        return;
     }
 
-    // initia;ize main thread
-    threads[0].tid = 0;
-    threads[0].state = THREAD_RUNNING;
-    threads[0].quantums = 1;
-    threads[0].sleep_until = 0;
-    threads[0].entry = NULL;
-    total_quantums = 1;
-    current_thread_id = 0;
-
-    // for critical section
-    sigemptyset(&sigvtalrm_set);
-    sigaddset(&sigvtalrm_set, SIGVTALRM);
+    // disable preemption (nests); the depth lives in the TCB, so it stays with the thread
+    // even if a tick moves it to another worker before the increment
+    thread_t *self = this_worker()->current;
+    self->preempt_disable++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (self->preempt_disable == 1 && num_workers > 1)
+    {
+        sched_lock_acquire();
+    }
+}
 
-    // Set up signal handler
-    struct sigaction sa;
-    sa.sa_handler = timer_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
+//--------------------------------------------------------------------------------------------------//
 
-    // Register the signal handler for virtual timer alarm
-    if (sigaction(SIGVTALRM, &sa, NULL) == -1)
+static void exit_crit_sec()
+{
+    if (!preemptive && num_workers == 1)
     {
-        fprintf(stderr, "system error: sigaction failed\n");
-        exit(1);
+        return;
     }
 
-    // Set virtual timer (sends SIGVTALRM every microsec)
-    struct itimerval timer;
-    // initial expiration time
-    timer.it_value.tv_sec = quantum_usecs / 1000000;
-    timer.it_value.tv_usec = quantum_usecs % 1000000;
-    // repeating interval
-    timer.it_interval.tv_sec = quantum_usecs / 1000000;
-    timer.it_interval.tv_usec = quantum_usecs % 1000000;
-
-    // Start the virtual timer (only when proccess is running)
-    if (setitimer(ITIMER_VIRTUAL, &timer, NULL) == -1)
+    // enable preemption, and run a tick that arrived while it was disabled
+    thread_t *self = this_worker()->current;
+    if (self->preempt_disable == 1 && num_workers > 1)
     {
-        fprintf(stderr, "system error: setitimer failed\n");
-        exit(1);
+        sched_lock_release();
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    self->preempt_disable--;
+    if (self->preempt_disable == 0 && this_worker()->resched_pending)
+    {
+        quantum_expired(true);
+    }
+    else if (self->preempt_disable == 0 && this_worker()->kick_pending)
+    {
+        kicked();
     }
-    return 0;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_spawn(thread_entry_point entry_point)
+static void queue_push(thread_queue_t *queue, thread_t *thread)
 {
-    enter_crit_sec();
-
-    // chech if entry point is null
-    if (entry_point == NULL)
+    // link at the tail
+    thread->queue = queue;
+    thread->next = NULL;
+    thread->prev = queue->tail;
+    if (queue->tail != NULL)
     {
-        fprintf(stderr, "system error: entry point cannot be NULL\n");
-        exit_crit_sec();
-        return -1;
+        queue->tail->next = thread;
     }
-
-    // Find available non-negative thread ID
-    int new_tid = -1;
-    for (int i = 0; i < MAX_THREAD_NUM; i++)
+    else
     {
-        if (threads[i].state == THREAD_UNUSED)
-        {
-            new_tid = i;
-            break;
-        }
+        queue->head = thread;
     }
+    queue->tail = thread;
+}
 
-    // if we reach max threads
-    if (new_tid == -1)
+//--------------------------------------------------------------------------------------------------//
+
+static void queue_push_front(thread_queue_t *queue, thread_t *thread)
+{
+    // link at the head, so the thread is popped next
+    thread->queue = queue;
+    thread->prev = NULL;
+    thread->next = queue->head;
+    if (queue->head != NULL)
     {
-        fprintf(stderr, "system error: max threads reached\n");
-        exit_crit_sec();
-        return -1;
+        queue->head->prev = thread;
     }
-
-    // Initializes thread
-    threads[new_tid].tid = new_tid;
-    threads[new_tid].state = THREAD_READY;
-    threads[new_tid].quantums = 0;
-    threads[new_tid].sleep_until = 0;
-    threads[new_tid].entry = entry_point;
-
-    // set up its context
-    setup_thread(new_tid, stacks[new_tid], entry_point);
-
-    exit_crit_sec();
-    return new_tid;
+    else
+    {
+        queue->tail = thread;
+    }
+    queue->head = thread;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_terminate(int tid)
+static void queue_remove(thread_queue_t *queue, thread_t *thread)
 {
-    enter_crit_sec();
-    // error if thread is unused
-    if (threads[tid].state == THREAD_UNUSED)
+    // unlink from wherever it sits in the queue
+    if (thread->prev != NULL)
     {
-        fprintf(stderr, "system error: thread doesn't exist\n");
-        exit_crit_sec();
-        return -1;
+        thread->prev->next = thread->next;
     }
-
-    // If terminating main thread (tid == 0), terminate entire process
-    if (tid == 0)
+    else
     {
-        // Release resources for all threads first
-        for (int i = 0; i < MAX_THREAD_NUM; i++)
-        {
-            threads[i].state = THREAD_UNUSED;
-        }
-        exit(1);
+        queue->head = thread->next;
     }
-
-    // Release all resources allocated for this thread
-    threads[tid].tid = -1;
-    threads[tid].state = THREAD_TERMINATED; // Thread unused?
-    threads[tid].quantums = 0;
-    threads[tid].sleep_until = 0;
-    threads[tid].entry = NULL; // Not entry_point
-    if (tid == current_thread_id)
+    if (thread->next != NULL)
     {
-        schedule_next();
-        // Should never reach here, but just in case:
+        thread->next->prev = thread->prev;
     }
-    exit_crit_sec();
-    return 0;
+    else
+    {
+        queue->tail = thread->prev;
+    }
+    thread->next = NULL;
+    thread->prev = NULL;
+    thread->queue = NULL;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-static void thread_wrapper(void)
+static thread_t *queue_pop(thread_queue_t *queue)
 {
-    int tid = current_thread_id;
-    thread_entry_point func = threads[tid].entry;
+    thread_t *thread = queue->head;
+    if (thread != NULL)
+    {
+        queue_remove(queue, thread);
+    }
+    return thread;
+}
 
-    // Call the actual thread function
-    func();
+//--------------------------------------------------------------------------------------------------//
 
-    // When function returns, terminate the thread (this won't return)
-    uthread_terminate(tid);
+static void kick_idle()
+{
+    // work for a worker that sleeps in idle_wait: wake one (it steals the work from our queue)
+    if (idle_waiting > 0 && !idle_kicked)
+    {
+        uint64_t one = 1;
+        idle_kicked = true;
+        if (write(wake_fd, &one, sizeof(one)) == -1)
+        {
+            idle_kicked = false;
+        }
+    }
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_block(int tid)
+static void account_ready(thread_t *thread)
 {
-    enter_crit_sec();
-    // error if thread is unused
-    if (threads[tid].state == THREAD_UNUSED)
+    // statistics: a blocked or new thread starts waiting (one still holding a worker is switched out
+    // right after, and run_next counts its time then; a requeued one just goes on waiting)
+    if (thread->worker != -1 || thread->state == THREAD_READY)
     {
-        fprintf(stderr, "system error: thread doesn't exist\n");
-        exit_crit_sec();
-        return -1;
+        return;
     }
-    // check if its the main thread
-    else if (threads[tid].tid == 0)
+    long long now = stats_clock();
+    if (thread->state_since != 0)
     {
-        fprintf(stderr, "system error: cannot block main thread\n");
-        exit_crit_sec();
-        return -1;
+        thread->blocked_ticks += now - thread->state_since;
     }
-    // if not unused or main thread, block it!
-    threads[tid].state = THREAD_BLOCKED;
-
-    exit_crit_sec();
-    return 0;
+    thread->state_since = now;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_resume(int tid)
+static void make_ready(thread_t *thread)
 {
-    enter_crit_sec();
-    // putlocked thread in ready state
-    if (threads[tid].state == THREAD_BLOCKED)
+    // READY threads are exactly the ones held by the scheduling policy
+    worker_t *worker = this_worker();
+    if (thread->state == THREAD_BLOCKED)
     {
-        threads[tid].state = THREAD_READY;
+        trace(TRACE_WAKE, thread->tid, -1, 0);
     }
-    else if (threads[tid].state == THREAD_READY || threads[tid].state == THREAD_RUNNING)
+    account_ready(thread);
+    thread->state = THREAD_READY;
+    sched->enqueue(worker->index, thread, false);
+    kick_idle();
+    // the running thread has someone to be preempted for now
+    if (tickless && worker->timer_usecs == 0)
     {
-        exit_crit_sec();
-        return 0;
+        update_timer(worker);
     }
-    // error if thread is unused
-    else if (threads[tid].state == THREAD_UNUSED)
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void make_ready_next(thread_t *thread)
+{
+    // like make_ready, but the thread runs as soon as this worker switches
+    worker_t *worker = this_worker();
+    if (thread->state == THREAD_BLOCKED)
     {
-        fprintf(stderr, "system error: thread doesn't exist\n");
-        exit_crit_sec();
-        return -1;
+        trace(TRACE_WAKE, thread->tid, -1, 0);
+    }
+    account_ready(thread);
+    thread->state = THREAD_READY;
+    sched->enqueue(worker->index, thread, true);
+    kick_idle();
+    if (tickless && worker->timer_usecs == 0)
+    {
+        update_timer(worker);
     }
-
-    exit_crit_sec();
-    return 0;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_sleep(int num_quantums)
+static void kick_worker(thread_t *thread)
 {
-    enter_crit_sec();
-    // error if main thread
-    if (current_thread_id == 0)
+    // a thread running on another worker changed state: make that worker reschedule now
+    if (thread->worker != -1 && &workers[thread->worker] != this_worker())
     {
-        fprintf(stderr, "system error: cannot put main thread to sleep\n");
-        exit_crit_sec();
-        return -1;
+        pthread_kill(workers[thread->worker].pthread, KICK_SIGNAL);
     }
-    // sleep & block :))
-    threads[current_thread_id].sleep_until = uthread_get_total_quantums() + num_quantums;
-    threads[current_thread_id].state = THREAD_BLOCKED;
-    exit_crit_sec();
-    return 0;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_get_tid()
+static long long quantum_key(thread_t *thread)
 {
-    return threads[current_thread_id].tid;
+    return thread->sleep_until;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_get_total_quantums()
+static long long deadline_key(thread_t *thread)
 {
-    return total_quantums;
+    return thread->sleep_deadline;
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-int uthread_get_quantums(int tid)
+static void heap_set(thread_heap_t *heap, int index, thread_t *thread)
 {
-    // error if thread is unused
-    if (threads[tid].state == THREAD_UNUSED)
-    {
-        fprintf(stderr, "system error: thread doesn't exist\n");
-        return -1;
-    }
-
-    // if the thread is running retrun currents + 1 (Before incrament)
-    else if (threads[tid].state == THREAD_RUNNING)
-    {
-        // current quantam + 1 instead
-        return threads[tid].quantums + 1;
-    }
-    // return without +1 (already incramented)
-    else
-    {
-        return threads[tid].quantums;
-    }
+    heap->entries[index] = thread;
+    thread->heap_index = index;
 }
 
 //--------------------------------------------------------------------------------------------------//
-/* ===================================================================== */
-/*              Internal Helper Functions and Structures                 */
-/* ===================================================================== */
-/*
- * The following declarations are intended for internal use by the thread library.
- * They provide guidance on how to structure your implementation using sigsetjmp/siglongjmp
- * and manually managed stacks.
- */
-//--------------------------------------------------------------------------------------------------//
 
-void schedule_next(void)
+static void heap_sift_up(thread_heap_t *heap, int index)
 {
-    enter_crit_sec();
-    int next_tid = -1;
-    for (int i = 1; i < MAX_THREAD_NUM; i++)
+    thread_t *thread = heap->entries[index];
+    while (index > 0)
     {
-        // round robbin
-        int check_tid = (current_thread_id + i) % MAX_THREAD_NUM;
-        if (threads[check_tid].state == THREAD_READY)
+        int parent = (index - 1) / 2;
+        if (heap->key(heap->entries[parent]) <= heap->key(thread))
         {
-            next_tid = check_tid;
             break;
         }
+        heap_set(heap, index, heap->entries[parent]);
+        index = parent;
     }
+    heap_set(heap, index, thread);
+}
+
+//--------------------------------------------------------------------------------------------------//
 
-    // if thread is not in a ready state return
-    if (next_tid == -1)
+static void heap_sift_down(thread_heap_t *heap, int index)
+{
+    thread_t *thread = heap->entries[index];
+    while (true)
     {
-        exit_crit_sec();
-        return;
+        int child = 2 * index + 1;
+        if (child >= heap->size)
+        {
+            break;
+        }
+        // pick the earlier of the two children
+        if (child + 1 < heap->size && heap->key(heap->entries[child + 1]) < heap->key(heap->entries[child]))
+        {
+            child++;
+        }
+        if (heap->key(thread) <= heap->key(heap->entries[child]))
+        {
+            break;
+        }
+        heap_set(heap, index, heap->entries[child]);
+        index = child;
     }
+    heap_set(heap, index, thread);
+}
 
-    // scheduule next
-    int prev_tid = current_thread_id;
-    current_thread_id = next_tid;
-    threads[next_tid].state = THREAD_RUNNING;
+//--------------------------------------------------------------------------------------------------//
 
-    exit_crit_sec();
-    context_switch(&threads[prev_tid], &threads[next_tid]);
+static void heap_push(thread_heap_t *heap, thread_t *thread)
+{
+    heap_set(heap, heap->size, thread);
+    heap->size++;
+    heap_sift_up(heap, thread->heap_index);
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-void context_switch(thread_t *current, thread_t *next)
+static void heap_remove(thread_heap_t *heap, thread_t *thread)
 {
-    // Save current thread context
-    int ret_val = sigsetjmp(current->env, 1);
+    int index = thread->heap_index;
+    thread->heap_index = -1;
+    heap->size--;
 
-    if (ret_val == 0)
+    // move the last entry into the hole and restore the heap order around it
+    if (index != heap->size)
     {
-        // First time --> jump to next thread
-        siglongjmp(next->env, 1);
+        heap_set(heap, index, heap->entries[heap->size]);
+        heap_sift_up(heap, index);
+        heap_sift_down(heap, heap->entries[index]->heap_index);
     }
-    // When we return here (ret_val != 0), this thread is being resumed
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-void timer_handler(int signum)
+static bool is_sleeping(thread_t *thread)
 {
-    enter_crit_sec();
-    // updates global quantum counters
-    total_quantums++;
+    // a thread sleeps either for quantums or until a monotonic deadline, never both
+    return thread->sleep_until != 0 || thread->sleep_deadline != 0;
+}
 
-    // Increments current thread's quantum count
-    threads[current_thread_id].quantums++;
+//--------------------------------------------------------------------------------------------------//
 
-    // If current thread's quantum expired --> move to READY
-    threads[current_thread_id].state = THREAD_READY;
+static void end_sleep(thread_t *thread)
+{
+    // take the thread out of whichever heap it sleeps in
+    heap_remove((thread->sleep_deadline != 0) ? &deadline_heap : &sleep_heap, thread);
+    thread->sleep_until = 0;
+    thread->sleep_deadline = 0;
+}
 
-    // Schedule next
-    schedule_next();
+//--------------------------------------------------------------------------------------------------//
 
-    exit_crit_sec();
+static void wake_sleepers()
+{
+    // only the expired threads are touched: O(expired * log sleepers) per tick
+    while (sleep_heap.size > 0 && sleep_heap.entries[0]->sleep_until < total_quantums)
+    {
+        thread_t *thread = sleep_heap.entries[0];
+        end_sleep(thread);
+
+        // still blocked with uthread_block --> wait for uthread_resume
+        if (!thread->blocked)
+        {
+            make_ready(thread);
+        }
+    }
 }
 
 //--------------------------------------------------------------------------------------------------//
 
-void setup_thread(int tid, char *stack, thread_entry_point entry_point)
+static long long monotonic_ns()
 {
-    address_t sp = (address_t)(stack + STACK_SIZE - sizeof(address_t));
-    address_t pc = (address_t)(thread_wrapper);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-    // Saves the current context
-    sigsetjmp(threads[tid].env, 1);
+//--------------------------------------------------------------------------------------------------//
+
+static long long stats_clock()
+{
+    // the time stamp counter costs about half a clock_gettime; it is scaled to ns when stats are read
+#ifdef __x86_64__
+    return (long long)__rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static long long stats_to_ns(long long ticks, long long now_ns, long long now_ticks)
+{
+#ifdef __x86_64__
+    // ticks per ns measured over the whole run so far
+    if (now_ticks <= init_ticks)
+    {
+        return 0;
+    }
+    return (long long)((long double)ticks * (now_ns - init_ns) / (now_ticks - init_ticks));
+#else
+    return ticks;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void arm_deadline_timer()
+{
+    // fire at the earliest deadline; reprogrammed only when that changes (0 disarms)
+    long long earliest = (deadline_heap.size > 0) ? deadline_heap.entries[0]->sleep_deadline : 0;
+    if (!deadline_timer_created || earliest == deadline_armed)
+    {
+        return;
+    }
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = earliest / 1000000000;
+    timer.it_value.tv_nsec = earliest % 1000000000;
+    if (timer_settime(deadline_timer, TIMER_ABSTIME, &timer, NULL) == -1)
+    {
+        fprintf(stderr, "system error: timer_settime failed\n");
+        exit(1);
+    }
+    deadline_armed = earliest;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static long long stats_ticks_ns(long long ticks, long long now_ticks)
+{
+#ifdef __x86_64__
+    // like stats_to_ns, with the scale re-measured only every STATS_RESCALE_TICKS so that the switch path
+    // rarely reads a second clock
+    if (stats_scale == 0 || now_ticks - stats_scale_ticks > STATS_RESCALE_TICKS)
+    {
+        if (now_ticks > init_ticks)
+        {
+            stats_scale = (long double)(monotonic_ns() - init_ns) / (now_ticks - init_ticks);
+        }
+        stats_scale_ticks = now_ticks;
+    }
+    return (long long)(ticks * stats_scale);
+#else
+    return ticks;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void wake_timed_sleepers()
+{
+    // same for sleeps on the monotonic clock
+    long long now = monotonic_ns();
+    while (deadline_heap.size > 0 && deadline_heap.entries[0]->sleep_deadline <= now)
+    {
+        thread_t *thread = deadline_heap.entries[0];
+        end_sleep(thread);
+        if (!thread->blocked)
+        {
+            make_ready(thread);
+        }
+    }
+    // a deadline that passed has fired the (one-shot) timer
+    if (deadline_armed != 0 && deadline_armed <= now)
+    {
+        deadline_armed = 0;
+    }
+    arm_deadline_timer();
+}
+
+
+//--------------------------------------------------------------------------------------------------//
+/* ===================================================================== */
+/*                          Scheduling Policies                          */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+
+// Round robin and MLFQ: FIFO queues per worker and level (round robin only uses level 0)
+
+static void refresh_level(thread_t *thread)
+{
+    // a boost happened since the thread was last queued --> back to its priority level
+    if (sched == &mlfq_ops && thread->boost_epoch != boost_epoch)
+    {
+        thread->level = thread->priority;
+        thread->boost_epoch = boost_epoch;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void queue_enqueue(int worker, thread_t *thread, bool next)
+{
+    refresh_level(thread);
+    thread_queue_t *queue = &workers[worker].run_queue[thread->level];
+    if (next)
+    {
+        queue_push_front(queue, thread);
+    }
+    else
+    {
+        queue_push(queue, thread);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void queue_dequeue(thread_t *thread)
+{
+    queue_remove(thread->queue, thread);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static thread_t *queue_pick_next(int worker)
+{
+    // highest level first; within a level our own queue first, then steal the longest-waiting
+    // thread of another worker
+    for (int level = 0; level < MLFQ_LEVELS; level++)
+    {
+        for (int i = 0; i < num_workers; i++)
+        {
+            thread_t *next = queue_pop(&workers[(worker + i) % num_workers].run_queue[level]);
+            if (next != NULL)
+            {
+                return next;
+            }
+        }
+    }
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool queue_has_ready(int worker)
+{
+    for (int level = 0; level < MLFQ_LEVELS; level++)
+    {
+        if (workers[worker].run_queue[level].head != NULL)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void mlfq_boost()
+{
+    // every thread gets its priority level back: queued ones now, the others when next queued
+    boost_epoch++;
+    for (int i = 0; i < num_workers; i++)
+    {
+        for (int level = 1; level < MLFQ_LEVELS; level++)
+        {
+            thread_queue_t *queue = &workers[i].run_queue[level];
+            thread_t *thread = queue->head;
+            queue->head = NULL;
+            queue->tail = NULL;
+            while (thread != NULL)
+            {
+                thread_t *next = thread->next;
+                refresh_level(thread);
+                queue_push(&workers[i].run_queue[thread->level], thread);
+                thread = next;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void mlfq_tick(int worker, thread_t *current, bool preempted)
+{
+    (void)worker;
+    // periodic boost, and a thread that used up its whole quantum sinks one level
+    if (total_quantums >= next_boost)
+    {
+        mlfq_boost();
+        next_boost = total_quantums + MLFQ_BOOST_INTERVAL;
+    }
+    if (preempted && current != NULL)
+    {
+        refresh_level(current);
+        if (current->level < MLFQ_LEVELS - 1)
+        {
+            current->level++;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static const uthread_sched_ops_t rr_ops = {
+    queue_enqueue, queue_dequeue, queue_pick_next, queue_has_ready, NULL, NULL
+};
+
+static const uthread_sched_ops_t mlfq_ops = {
+    queue_enqueue, queue_dequeue, queue_pick_next, queue_has_ready, mlfq_tick, NULL
+};
+
+//--------------------------------------------------------------------------------------------------//
+
+// Fair: one heap of the READY threads of all workers, keyed on virtual runtime
+
+static long long vruntime_key(thread_t *thread)
+{
+    return thread->vruntime;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void fair_enqueue(int worker, thread_t *thread, bool next)
+{
+    // a new or woken thread can't bank the time it didn't run: it starts at most one quantum behind
+    long long floor = fair_min_vruntime - quantum_length * 1000LL;
+    if (thread->vruntime < floor)
+    {
+        thread->vruntime = floor;
+    }
+    // a thread to run next takes the worker's slot ahead of the heap (without a change to its virtual
+    // runtime); one already there goes back to the heap
+    if (next)
+    {
+        thread_t *displaced = workers[worker].fair_next;
+        workers[worker].fair_next = thread;
+        if (displaced == NULL)
+        {
+            return;
+        }
+        thread = displaced;
+    }
+    heap_push(&fair_heap, thread);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void fair_dequeue(thread_t *thread)
+{
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (workers[i].fair_next == thread)
+        {
+            workers[i].fair_next = NULL;
+            return;
+        }
+    }
+    heap_remove(&fair_heap, thread);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static thread_t *fair_pick_next(int worker)
+{
+    // the thread in the worker's slot, else lowest virtual runtime first
+    thread_t *next = workers[worker].fair_next;
+    if (next != NULL)
+    {
+        workers[worker].fair_next = NULL;
+    }
+    else if (fair_heap.size > 0)
+    {
+        next = fair_heap.entries[0];
+        heap_remove(&fair_heap, next);
+    }
+    else
+    {
+        return NULL;
+    }
+    if (next->vruntime > fair_min_vruntime)
+    {
+        fair_min_vruntime = next->vruntime;
+    }
+    return next;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool fair_has_ready(int worker)
+{
+    return fair_heap.size > 0 || workers[worker].fair_next != NULL;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void fair_put_prev(int worker, thread_t *thread)
+{
+    // charge the time since the thread was switched in, scaled by its weight; both ends are stats clock
+    // readings the switches take anyway
+    if (thread != NULL && thread->state_since != 0)
+    {
+        long long now = workers[worker].switch_ticks;
+        thread->vruntime += stats_ticks_ns(now - thread->state_since, now) * FAIR_DEFAULT_WEIGHT / thread->weight;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static const uthread_sched_ops_t fair_ops = {
+    fair_enqueue, fair_dequeue, fair_pick_next, fair_has_ready, NULL, fair_put_prev
+};
+
+//--------------------------------------------------------------------------------------------------//
+
+static void reset_stats(thread_t *thread)
+{
+    thread->state_since = 0;
+    thread->run_ticks = 0;
+    thread->ready_ticks = 0;
+    thread->max_ready_ticks = 0;
+    thread->blocked_ticks = 0;
+    thread->voluntary_switches = 0;
+    thread->involuntary_switches = 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool grow_thread_table()
+{
+    // double everything that is indexed by tid
+    int new_capacity = thread_capacity * 2;
+    thread_t **new_threads = realloc(threads, new_capacity * sizeof(thread_t *));
+    if (new_threads == NULL)
+    {
+        return false;
+    }
+    threads = new_threads;
+    thread_t **new_sleep_heap = realloc(sleep_heap.entries, new_capacity * sizeof(thread_t *));
+    if (new_sleep_heap == NULL)
+    {
+        return false;
+    }
+    sleep_heap.entries = new_sleep_heap;
+    thread_t **new_deadline_heap = realloc(deadline_heap.entries, new_capacity * sizeof(thread_t *));
+    if (new_deadline_heap == NULL)
+    {
+        return false;
+    }
+    deadline_heap.entries = new_deadline_heap;
+    thread_t **new_fair_heap = realloc(fair_heap.entries, new_capacity * sizeof(thread_t *));
+    if (new_fair_heap == NULL)
+    {
+        return false;
+    }
+    fair_heap.entries = new_fair_heap;
+    int *new_free_tids = realloc(free_tids, new_capacity * sizeof(int));
+    if (new_free_tids == NULL)
+    {
+        return false;
+    }
+    free_tids = new_free_tids;
+    thread_capacity = new_capacity;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static int alloc_tid()
+{
+    // lowest released tid first
+    if (free_tid_count > 0)
+    {
+        int tid = free_tids[0];
+        int last = free_tids[--free_tid_count];
+        int index = 0;
+        while (true)
+        {
+            int child = 2 * index + 1;
+            if (child >= free_tid_count)
+            {
+                break;
+            }
+            if (child + 1 < free_tid_count && free_tids[child + 1] < free_tids[child])
+            {
+                child++;
+            }
+            if (last <= free_tids[child])
+            {
+                break;
+            }
+            free_tids[index] = free_tids[child];
+            index = child;
+        }
+        free_tids[index] = last;
+        return tid;
+    }
+
+    // no hole below the table size --> a fresh tid with a fresh TCB
+    if (thread_table_size == thread_capacity && !grow_thread_table())
+    {
+        return -1;
+    }
+    thread_t *thread = calloc(1, sizeof(thread_t));
+    if (thread == NULL)
+    {
+        return -1;
+    }
+    thread->state = THREAD_UNUSED;
+    thread->heap_index = -1;
+    thread->io_fd = -1;
+    threads[thread_table_size] = thread;
+    return thread_table_size++;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void release_tid(int tid)
+{
+    // push on the free tid heap; the TCB stays allocated for the next spawn
+    threads[tid]->state = THREAD_UNUSED;
+    int index = free_tid_count++;
+    while (index > 0 && free_tids[(index - 1) / 2] > tid)
+    {
+        free_tids[index] = free_tids[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    free_tids[index] = tid;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void release_stack(thread_t *thread);
+
+static void reap_zombie()
+{
+    // called right after a switch: the terminated thread's stack is no longer in use
+    worker_t *worker = this_worker();
+    if (worker->zombie_tid != -1)
+    {
+        release_stack(threads[worker->zombie_tid]);
+        release_tid(worker->zombie_tid);
+        worker->zombie_tid = -1;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static thread_t *find_thread(int tid)
+{
+    // NULL if no thread with this tid exists (a terminated thread only waits to be reaped)
+    if (tid < 0 || tid >= thread_table_size || threads[tid]->state == THREAD_UNUSED ||
+        threads[tid]->state == THREAD_TERMINATED)
+    {
+        return NULL;
+    }
+    return threads[tid];
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static int stack_class(size_t size)
+{
+    // smallest class whose 2^class pages hold size bytes
+    int cls = 0;
+    while (cls < STACK_POOL_CLASSES - 1 && (page_size << cls) < size)
+    {
+        cls++;
+    }
+    return cls;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static char *alloc_stack(size_t size, size_t *actual_size)
+{
+    int cls = stack_class(size);
+    *actual_size = page_size << cls;
+
+    // recycle a stack of the same class if there is one (no system call)
+    if (stack_pool[cls] != NULL)
+    {
+        stack_block_t *block = stack_pool[cls];
+        stack_pool[cls] = block->next;
+        return (char *)block;
+    }
+
+    // otherwise map a fresh one with a guard page below it
+    char *region = mmap(NULL, *actual_size + page_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        fprintf(stderr, "system error: failed to allocate stack\n");
+        return NULL;
+    }
+    if (mprotect(region, page_size, PROT_NONE) == -1)
+    {
+        fprintf(stderr, "system error: failed to protect stack guard page\n");
+        munmap(region, *actual_size + page_size);
+        return NULL;
+    }
+    return region + page_size;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void free_stack(char *stack, size_t size)
+{
+    // back to the pool of its class, kept mapped for the next spawn
+    stack_block_t *block = (stack_block_t *)stack;
+    int cls = stack_class(size);
+    block->next = stack_pool[cls];
+    stack_pool[cls] = block;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool is_shared(thread_t *thread)
+{
+    return shared_stack != NULL && thread->stack == shared_stack;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static char *saved_sp(thread_t *thread)
+{
+#ifdef UTHREAD_SWITCH_ASM
+    return (char *)thread->sp;
+#else
+    return thread->stack_sp;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static size_t stack_usage(thread_t *thread)
+{
+    // a thread on the shared stack is measured at every copy, and by its depth if it is on it right now
+    if (is_shared(thread))
+    {
+        size_t usage = thread->stack_peak;
+        if (thread == stack_owner && thread->state != THREAD_TERMINATED)
+        {
+            char *sp = (thread->state == THREAD_RUNNING) ? (char *)__builtin_frame_address(0) : saved_sp(thread);
+            if ((size_t)(shared_stack + shared_stack_size - sp) > usage)
+            {
+                usage = shared_stack + shared_stack_size - sp;
+            }
+        }
+        return usage;
+    }
+    // otherwise scan up from the bottom for the first word that was written to
+    uint64_t *word = (uint64_t *)thread->stack;
+    uint64_t *top = (uint64_t *)(thread->stack + thread->stack_size);
+    while (word < top && *word == STACK_FILL_WORD)
+    {
+        word++;
+    }
+    return (char *)top - (char *)word;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static stack_profile_t *find_stack_profile(thread_entry_point entry, bool insert)
+{
+    // keep the table at most half full, so probes stay short
+    if (insert && (num_stack_profiles + 1) * 2 > stack_profiles_capacity)
+    {
+        size_t capacity = (stack_profiles_capacity == 0) ? 16 : stack_profiles_capacity * 2;
+        stack_profile_t *table = calloc(capacity, sizeof(stack_profile_t));
+        if (table == NULL)
+        {
+            // learning is best effort: without room, the entry point keeps the default size
+            return NULL;
+        }
+        for (size_t i = 0; i < stack_profiles_capacity; i++)
+        {
+            if (stack_profiles[i].entry != NULL)
+            {
+                size_t slot = ((uintptr_t)stack_profiles[i].entry >> 4) & (capacity - 1);
+                while (table[slot].entry != NULL)
+                {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                table[slot] = stack_profiles[i];
+            }
+        }
+        free(stack_profiles);
+        stack_profiles = table;
+        stack_profiles_capacity = capacity;
+    }
+    if (stack_profiles_capacity == 0)
+    {
+        return NULL;
+    }
+
+    size_t slot = ((uintptr_t)entry >> 4) & (stack_profiles_capacity - 1);
+    while (stack_profiles[slot].entry != NULL && stack_profiles[slot].entry != entry)
+    {
+        slot = (slot + 1) & (stack_profiles_capacity - 1);
+    }
+    if (stack_profiles[slot].entry == NULL)
+    {
+        if (!insert)
+        {
+            return NULL;
+        }
+        stack_profiles[slot].entry = entry;
+        stack_profiles[slot].peak = 0;
+        num_stack_profiles++;
+    }
+    return &stack_profiles[slot];
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void learn_stack_usage(thread_t *thread)
+{
+    // the thread is terminating: remember how deep its entry point went
+    if (!adaptive_stacks || is_shared(thread))
+    {
+        return;
+    }
+    size_t usage = stack_usage(thread);
+    stack_profile_t *profile = find_stack_profile(thread->entry, true);
+    if (profile != NULL && usage > profile->peak)
+    {
+        profile->peak = usage;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static size_t default_stack_size(thread_entry_point entry)
+{
+    // twice the deepest use seen so far, as headroom for paths not taken yet (rounded up to a stack class)
+    if (adaptive_stacks)
+    {
+        stack_profile_t *profile = find_stack_profile(entry, false);
+        if (profile != NULL)
+        {
+            return profile->peak * 2;
+        }
+    }
+    return STACK_SIZE;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void release_stack(thread_t *thread)
+{
+    // a thread on the shared stack only has its copy to give back
+    if (is_shared(thread))
+    {
+        free(thread->stack_copy);
+        thread->stack_copy = NULL;
+        thread->stack_copy_size = 0;
+        thread->stack_copy_capacity = 0;
+        if (stack_owner == thread)
+        {
+            stack_owner = NULL;
+        }
+    }
+    else
+    {
+        free_stack(thread->stack, thread->stack_size);
+    }
+    thread->stack = NULL;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool reserve_stack_copy(thread_t *thread, size_t size)
+{
+    // right-sized: grown to fit, and shrunk once a quarter of it would do
+    if (size <= thread->stack_copy_capacity && size >= thread->stack_copy_capacity / 4)
+    {
+        return true;
+    }
+    size_t capacity = (size + STACK_COPY_GRANULE - 1) / STACK_COPY_GRANULE * STACK_COPY_GRANULE;
+    if (capacity == 0)
+    {
+        capacity = STACK_COPY_GRANULE;
+    }
+    char *copy = realloc(thread->stack_copy, capacity);
+    if (copy == NULL)
+    {
+        return false;
+    }
+    thread->stack_copy = copy;
+    thread->stack_copy_capacity = capacity;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void swap_shared_stack(thread_t *next)
+{
+    // save the used part of the owner's stack, from its saved stack pointer up to the top
+    // (a terminated owner's stack is garbage), then put next's back in place
+    char *top = shared_stack + shared_stack_size;
+    if (stack_owner != NULL && stack_owner->state != THREAD_TERMINATED)
+    {
+        char *sp = saved_sp(stack_owner);
+        size_t used = top - sp;
+        if (!reserve_stack_copy(stack_owner, used))
+        {
+            fprintf(stderr, "system error: failed to save a shared stack\n");
+            exit(1);
+        }
+        memcpy(stack_owner->stack_copy, sp, used);
+        stack_owner->stack_copy_size = used;
+        if (used > stack_owner->stack_peak)
+        {
+            stack_owner->stack_peak = used;
+        }
+    }
+    memcpy(top - next->stack_copy_size, next->stack_copy, next->stack_copy_size);
+    stack_owner = next;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void stack_copier_main(void)
+{
+    // switched to in place of a shared-stack thread whenever the owner of the shared stack switches to it
+    while (true)
+    {
+        thread_t *next = copy_target;
+        swap_shared_stack(next);
+        context_switch(&stack_copier, next);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+#ifndef UTHREAD_SWITCH_ASM
+address_t translate_address(address_t addr)
+{
+    address_t ret;
+    asm volatile("xor %%fs:0x30, %0\n"
+                 "rol $0x11 , %0\n"
+
+                 : "=g"(ret)
+                 : "0"(addr));
+    return ret;
+}
+#endif
+
+//--------------------------------------------------------------------------------------------------//
+
+static void thread_wrapper(void);
+static void chan_cancel(thread_t *thread);
+static void handle_io_events(struct epoll_event *events, int count);
+static void io_cancel(thread_t *thread);
+static void init_context(thread_t *thread, char *stack, size_t stack_size, void (*start)(void));
+static void stack_copier_main(void);
+
+//--------------------------------------------------------------------------------------------------//
+
+static void start_worker_timer(worker_t *worker)
+{
+    // no timer at all in cooperative mode
+    if (!preemptive)
+    {
+        return;
+    }
+
+    // SIGVTALRM to this kernel thread every quantum of its own CPU time
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGVTALRM;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &worker->timer) == -1)
+    {
+        fprintf(stderr, "system error: timer_create failed\n");
+        exit(1);
+    }
+    worker->timer_usecs = 0;
+    update_timer(worker);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void start_deadline_timer()
+{
+    // no signals at all in cooperative mode: sleepers wake at the first switch after their deadline
+    deadline_timer_created = false;
+    deadline_armed = 0;
+    if (!preemptive)
+    {
+        return;
+    }
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = KICK_SIGNAL;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &event, &deadline_timer) == -1)
+    {
+        fprintf(stderr, "system error: timer_create failed\n");
+        exit(1);
+    }
+    deadline_timer_created = true;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void set_worker_timer(worker_t *worker, int usecs)
+{
+    // reprogram only when the period changes (0 disarms)
+    if (usecs == worker->timer_usecs)
+    {
+        return;
+    }
+    struct itimerspec timer;
+    // initial expiration time
+    timer.it_value.tv_sec = usecs / 1000000;
+    timer.it_value.tv_nsec = (usecs % 1000000) * 1000;
+    // repeating interval
+    timer.it_interval = timer.it_value;
+    if (timer_settime(worker->timer, 0, &timer, NULL) == -1)
+    {
+        fprintf(stderr, "system error: timer_settime failed\n");
+        exit(1);
+    }
+    worker->timer_usecs = usecs;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void update_timer(worker_t *worker)
+{
+    if (!preemptive)
+    {
+        return;
+    }
+    thread_t *current = worker->current;
+    // the idle context blocks in epoll and is never preempted
+    if (current == &worker->idle)
+    {
+        if (tickless)
+        {
+            set_worker_timer(worker, 0);
+        }
+        return;
+    }
+    // tickless: ticks are only needed to switch to someone, or to count quantums for whoever waits
+    bool needed = !tickless || sched->has_ready(worker->index) || sleep_heap.size > 0 ||
+                  (deadline_heap.size > 0 && !deadline_timer_created) || io_armed > 0 || offload_waiting > 0;
+    // quantums grow with the MLFQ level
+    int usecs = ((current->quantum_usecs != 0) ? current->quantum_usecs : quantum_length) << current->level;
+    set_worker_timer(worker, needed ? usecs : 0);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool work_pending()
+{
+    // anything a worker could pick up without waiting
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (sched->has_ready(i))
+        {
+            return true;
+        }
+    }
+    return __atomic_load_n(&offload_done, __ATOMIC_RELAXED) != NULL;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void idle_wait()
+{
+    // sleep in epoll until an fd is ready, a thread is made READY (wake_fd) or the first sleeper is due
+    enter_crit_sec();
+    if (work_pending())
+    {
+        exit_crit_sec();
+        return;
+    }
+    long long timeout_ns = -1;
+    if (sleep_heap.size > 0)
+    {
+        // sleepers wake once total_quantums passes sleep_until
+        timeout_ns = (long long)(sleep_heap.entries[0]->sleep_until - total_quantums + 1) * quantum_length * 1000;
+    }
+    if (deadline_heap.size > 0)
+    {
+        long long until_deadline = deadline_heap.entries[0]->sleep_deadline - monotonic_ns();
+        if (until_deadline < 0)
+        {
+            until_deadline = 0;
+        }
+        if (timeout_ns < 0 || until_deadline < timeout_ns)
+        {
+            timeout_ns = until_deadline;
+        }
+    }
+    int seen_quantums = total_quantums;
+    idle_waiting++;
+    exit_crit_sec();
+
+    struct epoll_event events[IO_EVENT_BATCH];
+    long long start = monotonic_ns();
+    struct timespec timeout = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+    int count = epoll_pwait2(epoll_fd, events, IO_EVENT_BATCH, (timeout_ns >= 0) ? &timeout : NULL, NULL);
+    if (count == -1 && errno == ENOSYS)
+    {
+        // kernels before 5.11: millisecond timeouts, capped for far-off deadlines
+        int timeout_ms = (timeout_ns < 0) ? -1 :
+                         (timeout_ns >= INT_MAX * 1000000LL) ? INT_MAX : (int)((timeout_ns + 999999) / 1000000);
+        count = epoll_wait(epoll_fd, events, IO_EVENT_BATCH, timeout_ms);
+    }
+    long long elapsed = monotonic_ns() - start;
+
+    enter_crit_sec();
+    idle_waiting--;
+    if (count > 0)
+    {
+        handle_io_events(events, count);
+    }
+    // wall time spent idle counts as quantums, unless another worker kept counting them meanwhile
+    int idle_quantums = (int)(elapsed / ((long long)quantum_length * 1000));
+    if (idle_quantums > 0 && total_quantums == seen_quantums)
+    {
+        total_quantums += idle_quantums - 1;
+        quantum_expired(false);
+    }
+    exit_crit_sec();
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void idle_loop(void)
+{
+    // runs in the worker's idle context whenever no thread is runnable on it
+    while (true)
+    {
+        idle_wait();
+        schedule_next();
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    worker->pthread = pthread_self();
+    __atomic_store_n(&worker->kernel_tid, gettid(), __ATOMIC_RELEASE);
+    current_worker = worker;
+
+    // the pthread's own stack serves as the idle context
+    worker->current = &worker->idle;
+    worker->idle.preempt_disable = 0;
+    start_worker_timer(worker);
+    idle_loop();
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_init(int quantum_usecs)
+{
+    return uthread_init_ex(quantum_usecs, NULL);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_init_ex(int quantum_usecs, const uthread_init_attr_t *attr)
+{
+    // error if quantum is non-positive
+    if (quantum_usecs <= 0)
+    {
+        fprintf(stderr, "system error: quantum_usecs must be positive\n");
+        return -1;
+    }
+    // error if the shared stack would be shared between kernel threads
+    if (attr != NULL && attr->shared_stack && attr->num_workers > 1)
+    {
+        fprintf(stderr, "system error: shared stack mode needs a single worker\n");
+        return -1;
+    }
+    quantum_length = quantum_usecs;
+    preemptive = (attr == NULL || !attr->cooperative);
+    adaptive_stacks = (attr != NULL && attr->adaptive_stacks);
+    measure_stacks = adaptive_stacks || (attr != NULL && attr->measure_stacks);
+    tickless = (attr != NULL && attr->tickless);
+    // custom scheduling policy, or one of ours
+    if (attr != NULL && attr->sched_ops != NULL)
+    {
+        const uthread_sched_ops_t *ops = attr->sched_ops;
+        if (ops->enqueue == NULL || ops->dequeue == NULL || ops->pick_next == NULL || ops->has_ready == NULL)
+        {
+            fprintf(stderr, "system error: incomplete scheduler ops\n");
+            return -1;
+        }
+        sched = ops;
+    }
+    else if (attr != NULL && attr->policy == UTHREAD_SCHED_MLFQ)
+    {
+        sched = &mlfq_ops;
+    }
+    else if (attr != NULL && attr->policy == UTHREAD_SCHED_FAIR)
+    {
+        sched = &fair_ops;
+    }
+    else
+    {
+        sched = &rr_ops;
+    }
+    fair_min_vruntime = 0;
+    boost_epoch = 0;
+    next_boost = MLFQ_BOOST_INTERVAL;
+
+    // thread table starts with room for INITIAL_THREAD_NUM threads and grows on demand
+    thread_capacity = INITIAL_THREAD_NUM;
+    thread_table_size = 0;
+    free_tid_count = 0;
+    threads = malloc(thread_capacity * sizeof(thread_t *));
+    sleep_heap.entries = malloc(thread_capacity * sizeof(thread_t *));
+    deadline_heap.entries = malloc(thread_capacity * sizeof(thread_t *));
+    fair_heap.entries = malloc(thread_capacity * sizeof(thread_t *));
+    free_tids = malloc(thread_capacity * sizeof(int));
+    if (threads == NULL || sleep_heap.entries == NULL || deadline_heap.entries == NULL ||
+        fair_heap.entries == NULL || free_tids == NULL || alloc_tid() != 0)
+    {
+        fprintf(stderr, "system error: failed to allocate thread table\n");
+        exit(1);
+    }
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    // the kernel's signal frame grows with the CPU's vector state (AMX/AVX-512 need ~12 KiB)
+    min_stack_size = MIN_STACK_SIZE;
+    if (getauxval(AT_MINSIGSTKSZ) + MIN_STACK_SIZE / 2 > min_stack_size)
+    {
+        min_stack_size = getauxval(AT_MINSIGSTKSZ) + MIN_STACK_SIZE / 2;
+    }
+    sleep_heap.size = 0;
+    deadline_heap.size = 0;
+    fair_heap.size = 0;
+
+    // set up the workers; worker 0 is the calling kernel thread
+    num_workers = (attr != NULL && attr->num_workers > 1) ? attr->num_workers : 1;
+    workers = calloc(num_workers, sizeof(worker_t));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "system error: failed to allocate workers\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers[i].index = i;
+        workers[i].zombie_tid = -1;
+        workers[i].idle.tid = -1;
+        workers[i].idle.state = THREAD_RUNNING;
+        workers[i].idle.heap_index = -1;
+        workers[i].idle.worker = i;
+        workers[i].idle.entry = idle_loop;
+    }
+
+    // initia;ize main thread
+    threads[0]->tid = 0;
+    threads[0]->state = THREAD_RUNNING;
+    threads[0]->quantums = 1;
+    threads[0]->sleep_until = 0;
+    threads[0]->sleep_deadline = 0;
+    threads[0]->blocked = false;
+    threads[0]->entry = NULL;
+    threads[0]->stack = NULL;
+    threads[0]->stack_size = 0;
+    threads[0]->quantum_usecs = 0;
+    threads[0]->priority = 0;
+    threads[0]->level = 0;
+    threads[0]->boost_epoch = 0;
+    threads[0]->weight = FAIR_DEFAULT_WEIGHT;
+    threads[0]->vruntime = 0;
+    reset_stats(threads[0]);
+    init_ns = monotonic_ns();
+    init_ticks = stats_clock();
+    threads[0]->state_since = init_ticks;
+    threads[0]->preempt_disable = 0;
+    threads[0]->worker = 0;
+    total_quantums = 1;
+
+    workers[0].pthread = pthread_self();
+    workers[0].kernel_tid = gettid();
+    workers[0].current = threads[0];
+    current_worker = &workers[0];
+
+    // the main thread runs on the process stack, so worker 0 needs a stack for its idle context
+    size_t idle_stack_size;
+    char *idle_stack = alloc_stack(STACK_SIZE, &idle_stack_size);
+    if (idle_stack == NULL)
+    {
+        exit(1);
+    }
+    workers[0].idle.stack = idle_stack;
+    workers[0].idle.stack_size = idle_stack_size;
+    workers[0].idle.preempt_disable = 1;
+    init_context(&workers[0].idle, idle_stack, idle_stack_size, thread_wrapper);
+
+    // shared-stack mode: the run stack, and the copier that swaps its contents
+    shared_stack = NULL;
+    stack_owner = NULL;
+    if (attr != NULL && attr->shared_stack)
+    {
+        size_t run_stack_size = (attr->shared_stack_size != 0) ? attr->shared_stack_size : SHARED_STACK_SIZE;
+        if (run_stack_size < min_stack_size)
+        {
+            run_stack_size = min_stack_size;
+        }
+        size_t copier_stack_size;
+        char *copier_stack = alloc_stack(min_stack_size, &copier_stack_size);
+        shared_stack = alloc_stack(run_stack_size, &shared_stack_size);
+        if (shared_stack == NULL || copier_stack == NULL)
+        {
+            exit(1);
+        }
+        stack_copier.tid = -1;
+        stack_copier.stack = copier_stack;
+        stack_copier.stack_size = copier_stack_size;
+        init_context(&stack_copier, copier_stack, copier_stack_size, stack_copier_main);
+    }
+
+    // epoll instance for the I/O wrappers
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        fprintf(stderr, "system error: epoll_create1 failed\n");
+        exit(1);
+    }
+    // and the eventfd that wakes idle workers; edge-triggered, so each kick wakes a single one
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event wake_event;
+    wake_event.events = EPOLLIN | EPOLLET;
+    wake_event.data.fd = wake_fd;
+    if (wake_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake_event) == -1)
+    {
+        fprintf(stderr, "system error: eventfd failed\n");
+        exit(1);
+    }
+
+    // Register the signal handler for virtual timer alarm
+    install_tick_handler(false);
+    // and the one for kicks from other workers and from the deadline timer
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = kick_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_NODEFER;
+    if (sigaction(KICK_SIGNAL, &sa, NULL) == -1)
+    {
+        fprintf(stderr, "system error: sigaction failed\n");
+        exit(1);
+    }
+    start_deadline_timer();
+
+    // Start the quantum timer (only counts while this kernel thread is running)
+    start_worker_timer(&workers[0]);
+
+    // Start the other workers
+    for (int i = 1; i < num_workers; i++)
+    {
+        pthread_t pthread;
+        if (pthread_create(&pthread, NULL, worker_main, &workers[i]) != 0)
+        {
+            fprintf(stderr, "system error: pthread_create failed\n");
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_spawn(thread_entry_point entry_point)
+{
+    return uthread_spawn_ex(entry_point, NULL);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_spawn_ex(thread_entry_point entry_point, const uthread_attr_t *attr)
+{
+    enter_crit_sec();
+
+    // chech if entry point is null
+    if (entry_point == NULL)
+    {
+        fprintf(stderr, "system error: entry point cannot be NULL\n");
+        exit_crit_sec();
+        return -1;
+    }
+
+    // error if the quantum length is negative
+    if (attr != NULL && attr->quantum_usecs < 0)
+    {
+        fprintf(stderr, "system error: quantum_usecs cannot be negative\n");
+        exit_crit_sec();
+        return -1;
+    }
+
+    // take a stack from the pool (in shared-stack mode, the thread runs on the shared stack)
+    size_t stack_size = (attr != NULL && attr->stack_size != 0) ? attr->stack_size : default_stack_size(entry_point);
+    if (stack_size < min_stack_size)
+    {
+        stack_size = min_stack_size;
+    }
+    char *stack = shared_stack;
+    if (shared_stack != NULL)
+    {
+        stack_size = shared_stack_size;
+    }
+    else
+    {
+        stack = alloc_stack(stack_size, &stack_size);
+    }
+    if (stack == NULL)
+    {
+        exit_crit_sec();
+        return -1;
+    }
+
+    // Lowest available non-negative thread ID
+    int new_tid = alloc_tid();
+    if (new_tid == -1)
+    {
+        fprintf(stderr, "system error: failed to allocate thread\n");
+        if (shared_stack == NULL)
+        {
+            free_stack(stack, stack_size);
+        }
+        exit_crit_sec();
+        return -1;
+    }
+    // a thread on the shared stack starts out with its initial frame in its stack copy
+    if (shared_stack != NULL && !reserve_stack_copy(threads[new_tid], STACK_COPY_GRANULE))
+    {
+        fprintf(stderr, "system error: failed to allocate thread\n");
+        release_tid(new_tid);
+        exit_crit_sec();
+        return -1;
+    }
+
+    // Initializes thread
+    threads[new_tid]->tid = new_tid;
+    threads[new_tid]->stack = stack;
+    threads[new_tid]->stack_size = stack_size;
+    threads[new_tid]->quantums = 0;
+    threads[new_tid]->sleep_until = 0;
+    threads[new_tid]->sleep_deadline = 0;
+    threads[new_tid]->blocked = false;
+    threads[new_tid]->entry = entry_point;
+    threads[new_tid]->worker = -1;
+    threads[new_tid]->quantum_usecs = (attr != NULL) ? attr->quantum_usecs : 0;
+    threads[new_tid]->priority = 0;
+    threads[new_tid]->level = 0;
+    threads[new_tid]->boost_epoch = boost_epoch;
+    threads[new_tid]->weight = FAIR_DEFAULT_WEIGHT;
+    threads[new_tid]->vruntime = fair_min_vruntime;
+    reset_stats(threads[new_tid]);
+    // first switch to it happens inside schedule_next's critical section
+    threads[new_tid]->preempt_disable = 1;
+
+    // set up its context
+    setup_thread(new_tid, stack, entry_point);
+
+    // add to the end of the READY queue
+    trace(TRACE_SPAWN, new_tid, this_worker()->current->tid, 0);
+    make_ready(threads[new_tid]);
+
+    exit_crit_sec();
+    return new_tid;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_terminate(int tid)
+{
+    enter_crit_sec();
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+
+    trace(TRACE_TERMINATE, tid, this_worker()->current->tid, 0);
+
+    // If terminating main thread (tid == 0), terminate entire process
+    if (tid == 0)
+    {
+        // Release resources for all threads first
+        for (int i = 0; i < thread_table_size; i++)
+        {
+            threads[i]->state = THREAD_UNUSED;
+        }
+        exit(1);
+    }
+
+    // Remove from the scheduling structures
+    if (threads[tid]->state == THREAD_READY)
+    {
+        sched->dequeue(threads[tid]);
+    }
+    else if (threads[tid]->io_fd != -1)
+    {
+        io_cancel(threads[tid]);
+    }
+    else if (threads[tid]->queue != NULL)
+    {
+        queue_remove(threads[tid]->queue, threads[tid]);
+    }
+    if (is_sleeping(threads[tid]))
+    {
+        end_sleep(threads[tid]);
+    }
+    if (threads[tid]->chan_waiters != NULL)
+    {
+        chan_cancel(threads[tid]);
+    }
+    if (threads[tid]->offload != NULL)
+    {
+        // the helper still owns the call; whoever collects it frees it
+        threads[tid]->offload->thread = NULL;
+        threads[tid]->offload = NULL;
+    }
+
+    learn_stack_usage(threads[tid]);
+    threads[tid]->state = THREAD_TERMINATED;
+    threads[tid]->quantums = 0;
+    threads[tid]->sleep_until = 0;
+    threads[tid]->sleep_deadline = 0;
+    threads[tid]->blocked = false;
+    threads[tid]->entry = NULL; // Not entry_point
+    if (threads[tid] == this_worker()->current)
+    {
+        // the next thread reaps our stack and tid after the switch
+        schedule_next();
+        // Should never reach here, but just in case:
+    }
+    else if (threads[tid]->worker != -1)
+    {
+        // running on another worker: it is reaped there once that worker switches away from it
+        kick_worker(threads[tid]);
+    }
+    else
+    {
+        // Release all resources allocated for this thread, the tid can be reused
+        release_stack(threads[tid]);
+        release_tid(tid);
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void thread_wrapper(void)
+{
+    thread_t *self = this_worker()->current;
+    int tid = self->tid;
+    thread_entry_point func = self->entry;
+
+    // we were switched to from inside schedule_next's critical section
+    reap_zombie();
+    exit_crit_sec();
+
+    // Call the actual thread function
+    func();
+
+    // When function returns, terminate the thread (this won't return)
+    uthread_terminate(tid);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_block(int tid)
+{
+    enter_crit_sec();
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // check if its the main thread
+    else if (threads[tid]->tid == 0)
+    {
+        fprintf(stderr, "system error: cannot block main thread\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // if not unused or main thread, block it!
+    // (a thread waiting on a mutex, condition or semaphore stays in that wait queue)
+    trace(TRACE_BLOCK, tid, this_worker()->current->tid, 0);
+    if (threads[tid]->state == THREAD_READY)
+    {
+        sched->dequeue(threads[tid]);
+    }
+    threads[tid]->blocked = true;
+    threads[tid]->state = THREAD_BLOCKED;
+
+    // a thread blocking itself gives up the CPU; one running on another worker is switched out there
+    if (threads[tid] == this_worker()->current)
+    {
+        schedule_next();
+    }
+    else
+    {
+        kick_worker(threads[tid]);
+    }
+
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_resume(int tid)
+{
+    enter_crit_sec();
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // putlocked thread in ready state
+    trace(TRACE_RESUME, tid, this_worker()->current->tid, 0);
+    if (threads[tid]->state == THREAD_BLOCKED)
+    {
+        threads[tid]->blocked = false;
+        // a sleeping or waiting thread becomes ready only when its sleep or wait ends
+        if (threads[tid]->worker != -1)
+        {
+            // blocked from another worker but not switched out yet: just keep running
+            threads[tid]->state = THREAD_RUNNING;
+        }
+        else if (!is_sleeping(threads[tid]) && threads[tid]->queue == NULL &&
+                 threads[tid]->chan_waiters == NULL && threads[tid]->offload == NULL)
+        {
+            make_ready(threads[tid]);
+        }
+    }
+    else if (threads[tid]->state == THREAD_READY || threads[tid]->state == THREAD_RUNNING)
+    {
+        exit_crit_sec();
+        return 0;
+    }
+
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_sleep(int num_quantums)
+{
+    enter_crit_sec();
+    thread_t *self = this_worker()->current;
+    // error if main thread
+    if (self->tid == 0)
+    {
+        fprintf(stderr, "system error: cannot put main thread to sleep\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // error if negative (a wake-up quantum of 0 would read as not sleeping, leaving the thread in the heap)
+    if (num_quantums < 0)
+    {
+        fprintf(stderr, "system error: sleep time cannot be negative\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // sleep & block :))
+    trace(TRACE_SLEEP, self->tid, num_quantums, 0);
+    self->sleep_until = uthread_get_total_quantums() + num_quantums;
+    self->state = THREAD_BLOCKED;
+    heap_push(&sleep_heap, self);
+    schedule_next();
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_sleep_usec(long usecs)
+{
+    // error if usecs is negative
+    if (usecs < 0)
+    {
+        fprintf(stderr, "system error: sleep time cannot be negative\n");
+        return -1;
+    }
+    // saturate instead of overflowing: a deadline past LLONG_MAX ns never comes anyway
+    long long now = monotonic_ns();
+    long long deadline = (usecs > (LLONG_MAX - now) / 1000) ? LLONG_MAX : now + usecs * 1000LL;
+    struct timespec until = { deadline / 1000000000, deadline % 1000000000 };
+    return uthread_sleep_until(&until);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_sleep_until(const struct timespec *deadline)
+{
+    // error if the deadline isn't a valid time
+    if (deadline == NULL || deadline->tv_sec < 0 || deadline->tv_nsec < 0 || deadline->tv_nsec >= 1000000000)
+    {
+        fprintf(stderr, "system error: invalid deadline\n");
+        return -1;
+    }
+    enter_crit_sec();
+    thread_t *self = this_worker()->current;
+    // error if main thread
+    if (self->tid == 0)
+    {
+        fprintf(stderr, "system error: cannot put main thread to sleep\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // already due --> don't sleep at all (a deadline too far for nanoseconds saturates)
+    long long deadline_ns = (deadline->tv_sec >= LLONG_MAX / 1000000000) ? LLONG_MAX :
+                            deadline->tv_sec * 1000000000LL + deadline->tv_nsec;
+    if (deadline_ns <= monotonic_ns())
+    {
+        exit_crit_sec();
+        return 0;
+    }
+    // woken by the deadline timer (or, in cooperative mode, by the first switch after the deadline),
+    // or by the idle loop's timeout
+    trace(TRACE_SLEEP, self->tid, -1, 0);
+    self->sleep_deadline = deadline_ns;
+    self->state = THREAD_BLOCKED;
+    heap_push(&deadline_heap, self);
+    arm_deadline_timer();
+    schedule_next();
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_yield()
+{
+    // giving up the CPU ends the quantum just like a timer tick (but keeps the MLFQ level)
+    quantum_expired(false);
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static int switch_to(int tid, bool block)
+{
+    enter_crit_sec();
+    worker_t *worker = this_worker();
+    thread_t *self = worker->current;
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // error if switching to ourselves
+    if (threads[tid] == self)
+    {
+        fprintf(stderr, "system error: cannot switch to the calling thread\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // check if its the main thread
+    if (block && self->tid == 0)
+    {
+        fprintf(stderr, "system error: cannot block main thread\n");
+        exit_crit_sec();
+        return -1;
+    }
+
+    // the target runs next if it is READY, or blocked with uthread_block and waiting for nothing else
+    // (it is resumed); otherwise the handoff falls back to the scheduler
+    thread_t *target = threads[tid];
+    bool direct = false;
+    if (target->state == THREAD_READY)
+    {
+        sched->dequeue(target);
+        direct = true;
+    }
+    else if (target->state == THREAD_BLOCKED && target->blocked && target->worker == -1 &&
+             !is_sleeping(target) && target->queue == NULL && target->chan_waiters == NULL &&
+             target->offload == NULL)
+    {
+        // traced like uthread_resume and the wakeup it causes
+        trace(TRACE_RESUME, tid, self->tid, 0);
+        trace(TRACE_WAKE, tid, -1, 0);
+        target->blocked = false;
+        account_ready(target);
+        direct = true;
+    }
+
+    // the caller gives up the CPU without ending the quantum
+    if (block)
+    {
+        trace(TRACE_BLOCK, self->tid, self->tid, 0);
+        self->blocked = true;
+        self->state = THREAD_BLOCKED;
+    }
+    if (!direct)
+    {
+        schedule_next();
+    }
+    else
+    {
+        // what schedule_next does, minus the pick
+        worker->switch_ticks = stats_clock();
+        if (sched->put_prev != NULL)
+        {
+            sched->put_prev(worker->index, self);
+        }
+        if (!block)
+        {
+            make_ready(self);
+        }
+        run_next(worker, self, target);
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_switch_to(int tid)
+{
+    return switch_to(tid, false);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_switch_to_block(int tid)
+{
+    return switch_to(tid, true);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_set_quantum(int tid, int quantum_usecs)
+{
+    enter_crit_sec();
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // error if the quantum length is negative
+    if (quantum_usecs < 0)
+    {
+        fprintf(stderr, "system error: quantum_usecs cannot be negative\n");
+        exit_crit_sec();
+        return -1;
+    }
+    threads[tid]->quantum_usecs = quantum_usecs;
+    if (threads[tid] == this_worker()->current)
+    {
+        update_timer(this_worker());
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_set_priority(int tid, int priority)
+{
+    enter_crit_sec();
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // error if the level doesn't exist
+    if (priority < 0 || priority >= MLFQ_LEVELS)
+    {
+        fprintf(stderr, "system error: invalid priority\n");
+        exit_crit_sec();
+        return -1;
+    }
+    thread_t *thread = threads[tid];
+    thread->priority = priority;
+    if (sched == &mlfq_ops)
+    {
+        // straight to the new level, requeued there if it is waiting to run
+        thread->level = priority;
+        thread->boost_epoch = boost_epoch;
+        if (thread->state == THREAD_READY)
+        {
+            sched->dequeue(thread);
+            make_ready(thread);
+        }
+        else if (thread == this_worker()->current)
+        {
+            update_timer(this_worker());
+        }
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_set_weight(int tid, int weight)
+{
+    enter_crit_sec();
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // error if the weight isn't positive
+    if (weight <= 0)
+    {
+        fprintf(stderr, "system error: invalid weight\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // applies from the next time the thread is charged; its place among the READY threads doesn't change
+    threads[tid]->weight = weight;
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_get_tid()
+{
+    return this_worker()->current->tid;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_get_total_quantums()
+{
+    return total_quantums;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_get_quantums(int tid)
+{
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        return -1;
+    }
+
+    // if the thread is running retrun currents + 1 (Before incrament)
+    else if (threads[tid]->state == THREAD_RUNNING)
+    {
+        // current quantam + 1 instead
+        return threads[tid]->quantums + 1;
+    }
+    // return without +1 (already incramented)
+    else
+    {
+        return threads[tid]->quantums;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+ssize_t uthread_get_stack_usage(int tid)
+{
+    enter_crit_sec();
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // error if the thread runs on the process stack
+    if (threads[tid]->stack == NULL)
+    {
+        fprintf(stderr, "system error: the main thread's stack is not measured\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // error if its stack was not filled with the pattern
+    if (!measure_stacks && !is_shared(threads[tid]))
+    {
+        fprintf(stderr, "system error: stack usage is not measured\n");
+        exit_crit_sec();
+        return -1;
+    }
+    ssize_t usage = stack_usage(threads[tid]);
+    exit_crit_sec();
+    return usage;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_get_stats(int tid, uthread_stats_t *out)
+{
+    enter_crit_sec();
+    // error if thread is unused
+    if (find_thread(tid) == NULL)
+    {
+        fprintf(stderr, "system error: thread doesn't exist\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // error if there's nowhere to put them
+    if (out == NULL)
+    {
+        fprintf(stderr, "system error: stats cannot be NULL\n");
+        exit_crit_sec();
+        return -1;
+    }
+    thread_t *thread = threads[tid];
+    long long now = stats_clock();
+    long long now_ns = monotonic_ns();
+    long long run = thread->run_ticks;
+    long long ready = thread->ready_ticks;
+    long long blocked = thread->blocked_ticks;
+
+    // the state the thread is in right now counts too
+    if (thread->state_since != 0)
+    {
+        if (thread->state == THREAD_RUNNING)
+        {
+            run += now - thread->state_since;
+        }
+        else if (thread->state == THREAD_READY)
+        {
+            ready += now - thread->state_since;
+        }
+        else if (thread->state == THREAD_BLOCKED)
+        {
+            blocked += now - thread->state_since;
+        }
+    }
+    out->run_ns = stats_to_ns(run, now_ns, now);
+    out->ready_ns = stats_to_ns(ready, now_ns, now);
+    out->max_ready_ns = stats_to_ns(thread->max_ready_ticks, now_ns, now);
+    out->blocked_ns = stats_to_ns(blocked, now_ns, now);
+    out->voluntary_switches = thread->voluntary_switches;
+    out->involuntary_switches = thread->involuntary_switches;
+
+    out->total_switches = 0;
+    out->ticks_taken = 0;
+    out->ticks_deferred = 0;
+    for (int i = 0; i < num_workers; i++)
+    {
+        out->total_switches += workers[i].switches;
+        out->ticks_taken += workers[i].ticks_taken;
+        out->ticks_deferred += workers[i].ticks_deferred;
+    }
+    out->elapsed_ns = now_ns - init_ns;
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+/* ===================================================================== */
+/*                       Synchronization Primitives                      */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+
+static void wait_on(thread_queue_t *waiters)
+{
+    // park the running thread in a wait queue; whoever wakes it hands it straight to a READY queue
+    thread_t *self = this_worker()->current;
+    self->state = THREAD_BLOCKED;
+    queue_push(waiters, self);
+    schedule_next();
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static thread_t *wake_one(thread_queue_t *waiters)
+{
+    // longest waiter first; if it was also blocked with uthread_block it waits for uthread_resume
+    thread_t *thread = queue_pop(waiters);
+    if (thread != NULL && !thread->blocked)
+    {
+        make_ready(thread);
+    }
+    return thread;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_mutex_init(uthread_mutex_t *mutex)
+{
+    mutex->owner = -1;
+    mutex->waiters.head = NULL;
+    mutex->waiters.tail = NULL;
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_mutex_lock(uthread_mutex_t *mutex)
+{
+    enter_crit_sec();
+    int tid = this_worker()->current->tid;
+    // free --> take it
+    if (mutex->owner == -1)
+    {
+        mutex->owner = tid;
+    }
+    // error if we already hold it (not recursive)
+    else if (mutex->owner == tid)
+    {
+        fprintf(stderr, "system error: mutex already locked by this thread\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // taken --> wait; unlock hands the mutex over to us
+    else
+    {
+        wait_on(&mutex->waiters);
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_mutex_trylock(uthread_mutex_t *mutex)
+{
+    enter_crit_sec();
+    // never waits
+    if (mutex->owner != -1)
+    {
+        exit_crit_sec();
+        return -1;
+    }
+    mutex->owner = this_worker()->current->tid;
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void mutex_release(uthread_mutex_t *mutex)
+{
+    // hand the mutex directly to the longest waiter, if any
+    thread_t *next = wake_one(&mutex->waiters);
+    mutex->owner = (next != NULL) ? next->tid : -1;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_mutex_unlock(uthread_mutex_t *mutex)
+{
+    enter_crit_sec();
+    // error if we don't hold it
+    if (mutex->owner != this_worker()->current->tid)
+    {
+        fprintf(stderr, "system error: mutex not locked by this thread\n");
+        exit_crit_sec();
+        return -1;
+    }
+    mutex_release(mutex);
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_cond_init(uthread_cond_t *cond)
+{
+    cond->waiters.head = NULL;
+    cond->waiters.tail = NULL;
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_cond_wait(uthread_cond_t *cond, uthread_mutex_t *mutex)
+{
+    enter_crit_sec();
+    // error if we don't hold the mutex
+    if (mutex->owner != this_worker()->current->tid)
+    {
+        fprintf(stderr, "system error: mutex not locked by this thread\n");
+        exit_crit_sec();
+        return -1;
+    }
+
+    // release and start waiting atomically, so no signal can be missed
+    mutex_release(mutex);
+    wait_on(&cond->waiters);
+
+    // signaled --> take the mutex back before returning
+    int tid = this_worker()->current->tid;
+    if (mutex->owner == -1)
+    {
+        mutex->owner = tid;
+    }
+    else
+    {
+        wait_on(&mutex->waiters);
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_cond_signal(uthread_cond_t *cond)
+{
+    enter_crit_sec();
+    wake_one(&cond->waiters);
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_cond_broadcast(uthread_cond_t *cond)
+{
+    enter_crit_sec();
+    while (wake_one(&cond->waiters) != NULL)
+    {
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_sem_init(uthread_sem_t *sem, int value)
+{
+    // error if value is negative
+    if (value < 0)
+    {
+        fprintf(stderr, "system error: semaphore value cannot be negative\n");
+        return -1;
+    }
+    sem->value = value;
+    sem->waiters.head = NULL;
+    sem->waiters.tail = NULL;
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_sem_wait(uthread_sem_t *sem)
+{
+    enter_crit_sec();
+    // available --> take it; otherwise wait, post hands the unit over to us
+    if (sem->value > 0)
+    {
+        sem->value--;
+    }
+    else
+    {
+        wait_on(&sem->waiters);
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_sem_trywait(uthread_sem_t *sem)
+{
+    enter_crit_sec();
+    // never waits
+    if (sem->value == 0)
+    {
+        exit_crit_sec();
+        return -1;
+    }
+    sem->value--;
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_sem_post(uthread_sem_t *sem)
+{
+    enter_crit_sec();
+    // a waiter gets the unit directly
+    if (wake_one(&sem->waiters) == NULL)
+    {
+        sem->value++;
+    }
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+/* ===================================================================== */
+/*                               Channels                                */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+
+// A thread waiting in a channel operation links one record per operation of its select into the
+// senders or receivers list of that operation's channel. The records live on the waiting thread's
+// stack; whoever completes one of them unlinks all of them, so a select completes exactly once.
+typedef struct chan_waiter {
+    thread_t *thread;               // the waiting thread
+    uthread_chan_op_t *op;          // its operation; the item travels through op->item
+    int index;                      // position of op in the select
+    int *completed;                 // set to index when this operation completes
+    struct chan_waiter **list;      // &chan->senders or &chan->receivers
+    struct chan_waiter *next;       // lists are circular: the head's prev is the tail
+    struct chan_waiter *prev;
+} chan_waiter_t;
+
+//--------------------------------------------------------------------------------------------------//
+
+static void waiter_link(chan_waiter_t **list, chan_waiter_t *waiter)
+{
+    // append at the tail of the circular list
+    waiter->list = list;
+    if (*list == NULL)
+    {
+        waiter->next = waiter;
+        waiter->prev = waiter;
+        *list = waiter;
+    }
+    else
+    {
+        waiter->next = *list;
+        waiter->prev = (*list)->prev;
+        (*list)->prev->next = waiter;
+        (*list)->prev = waiter;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void waiter_unlink(chan_waiter_t *waiter)
+{
+    chan_waiter_t **list = waiter->list;
+    if (waiter->next == waiter)
+    {
+        *list = NULL;
+    }
+    else
+    {
+        waiter->prev->next = waiter->next;
+        waiter->next->prev = waiter->prev;
+        if (*list == waiter)
+        {
+            *list = waiter->next;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void chan_cancel(thread_t *thread)
+{
+    // take every record of the thread's select off its channel
+    for (int i = 0; i < thread->num_chan_waiters; i++)
+    {
+        waiter_unlink(&thread->chan_waiters[i]);
+    }
+    thread->chan_waiters = NULL;
+    thread->num_chan_waiters = 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void chan_complete(chan_waiter_t *waiter)
+{
+    // the waiter's operation is done: end its wait and let it run next (unless uthread_block holds it)
+    thread_t *thread = waiter->thread;
+    *waiter->completed = waiter->index;
+    chan_cancel(thread);
+    if (!thread->blocked)
+    {
+        make_ready_next(thread);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool chan_try_send(uthread_chan_t *chan, void *item)
+{
+    // a waiting receiver takes the item directly
+    if (chan->receivers != NULL)
+    {
+        chan_waiter_t *receiver = chan->receivers;
+        receiver->op->item = item;
+        chan_complete(receiver);
+        return true;
+    }
+    // otherwise buffer it if there's room
+    if (chan->count < chan->capacity)
+    {
+        chan->buffer[(chan->head + chan->count) % chan->capacity] = item;
+        chan->count++;
+        return true;
+    }
+    return false;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool chan_try_recv(uthread_chan_t *chan, void **item)
+{
+    // oldest buffered item first; the slot it frees goes to the longest-waiting sender
+    if (chan->count > 0)
+    {
+        *item = chan->buffer[chan->head];
+        chan->head = (chan->head + 1) % chan->capacity;
+        chan->count--;
+        if (chan->senders != NULL)
+        {
+            chan_waiter_t *sender = chan->senders;
+            chan->buffer[(chan->head + chan->count) % chan->capacity] = sender->op->item;
+            chan->count++;
+            chan_complete(sender);
+        }
+        return true;
+    }
+    // unbuffered --> take the item straight from a waiting sender
+    if (chan->senders != NULL)
+    {
+        chan_waiter_t *sender = chan->senders;
+        *item = sender->op->item;
+        chan_complete(sender);
+        return true;
+    }
+    return false;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_chan_init(uthread_chan_t *chan, int capacity)
+{
+    // error if capacity is negative
+    if (capacity < 0)
+    {
+        fprintf(stderr, "system error: channel capacity cannot be negative\n");
+        return -1;
+    }
+    chan->buffer = NULL;
+    if (capacity > 0)
+    {
+        chan->buffer = malloc(capacity * sizeof(void *));
+        if (chan->buffer == NULL)
+        {
+            fprintf(stderr, "system error: memory allocation failed\n");
+            return -1;
+        }
+    }
+    chan->capacity = capacity;
+    chan->head = 0;
+    chan->count = 0;
+    chan->senders = NULL;
+    chan->receivers = NULL;
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_chan_destroy(uthread_chan_t *chan)
+{
+    enter_crit_sec();
+    // error if anyone is still waiting on it
+    if (chan->senders != NULL || chan->receivers != NULL)
+    {
+        fprintf(stderr, "system error: threads are waiting on the channel\n");
+        exit_crit_sec();
+        return -1;
+    }
+    free(chan->buffer);
+    chan->buffer = NULL;
+    chan->capacity = 0;
+    chan->count = 0;
+    exit_crit_sec();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_chan_select(uthread_chan_op_t *ops, int num_ops, bool block)
+{
+    // error if there is nothing to select from
+    if (ops == NULL || num_ops < 1)
+    {
+        fprintf(stderr, "system error: invalid channel operations\n");
+        return -1;
+    }
+    for (int i = 0; i < num_ops; i++)
+    {
+        if (ops[i].chan == NULL || (ops[i].dir != UTHREAD_CHAN_SEND && ops[i].dir != UTHREAD_CHAN_RECV))
+        {
+            fprintf(stderr, "system error: invalid channel operations\n");
+            return -1;
+        }
+    }
+
+    enter_crit_sec();
+    // the first operation that can proceed right away wins
+    for (int i = 0; i < num_ops; i++)
+    {
+        bool done = (ops[i].dir == UTHREAD_CHAN_SEND) ? chan_try_send(ops[i].chan, ops[i].item)
+                                                      : chan_try_recv(ops[i].chan, &ops[i].item);
+        if (done)
+        {
+            exit_crit_sec();
+            return i;
+        }
+    }
+    if (!block)
+    {
+        exit_crit_sec();
+        return -1;
+    }
+
+    // wait on all the channels at once; the thread that completes one of the operations wakes us
+    thread_t *self = this_worker()->current;
+    chan_waiter_t stack_waiters[is_shared(self) ? 1 : num_ops];
+    chan_waiter_t *waiters = stack_waiters;
+    uthread_chan_op_t *wait_ops = ops;
+    int completed = -1;
+    int *result = &completed;
+    if (is_shared(self))
+    {
+        // our stack is copied away while we wait, so what the others touch meanwhile goes to the heap
+        waiters = malloc(num_ops * (sizeof(chan_waiter_t) + sizeof(uthread_chan_op_t)) + sizeof(int));
+        if (waiters == NULL)
+        {
+            fprintf(stderr, "system error: memory allocation failed\n");
+            exit_crit_sec();
+            return -1;
+        }
+        wait_ops = (uthread_chan_op_t *)(waiters + num_ops);
+        memcpy(wait_ops, ops, num_ops * sizeof(uthread_chan_op_t));
+        result = (int *)(wait_ops + num_ops);
+        *result = -1;
+    }
+    for (int i = 0; i < num_ops; i++)
+    {
+        waiters[i].thread = self;
+        waiters[i].op = &wait_ops[i];
+        waiters[i].index = i;
+        waiters[i].completed = result;
+        waiter_link((ops[i].dir == UTHREAD_CHAN_SEND) ? &ops[i].chan->senders : &ops[i].chan->receivers,
+                    &waiters[i]);
+    }
+    self->chan_waiters = waiters;
+    self->num_chan_waiters = num_ops;
+    self->state = THREAD_BLOCKED;
+    schedule_next();
+    completed = *result;
+    if (waiters != stack_waiters)
+    {
+        for (int i = 0; i < num_ops; i++)
+        {
+            ops[i].item = wait_ops[i].item;
+        }
+        free(waiters);
+    }
+    exit_crit_sec();
+    return completed;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_chan_send(uthread_chan_t *chan, void *item)
+{
+    uthread_chan_op_t op = { chan, UTHREAD_CHAN_SEND, item };
+    return (uthread_chan_select(&op, 1, true) == 0) ? 0 : -1;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_chan_recv(uthread_chan_t *chan, void **item)
+{
+    uthread_chan_op_t op = { chan, UTHREAD_CHAN_RECV, NULL };
+    if (uthread_chan_select(&op, 1, true) != 0)
+    {
+        return -1;
+    }
+    *item = op.item;
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_chan_trysend(uthread_chan_t *chan, void *item)
+{
+    uthread_chan_op_t op = { chan, UTHREAD_CHAN_SEND, item };
+    return (uthread_chan_select(&op, 1, false) == 0) ? 0 : -1;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_chan_tryrecv(uthread_chan_t *chan, void **item)
+{
+    uthread_chan_op_t op = { chan, UTHREAD_CHAN_RECV, NULL };
+    if (uthread_chan_select(&op, 1, false) != 0)
+    {
+        return -1;
+    }
+    *item = op.item;
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+/* ===================================================================== */
+/*                            Non-blocking I/O                           */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+
+static io_fd_t *io_record(int fd)
+{
+    // grow the table to cover fd; records stay put since threads' queue pointers refer to them
+    if (fd >= io_fds_capacity)
+    {
+        int capacity = (io_fds_capacity > 0) ? io_fds_capacity : 64;
+        while (capacity <= fd)
+        {
+            capacity *= 2;
+        }
+        io_fd_t **new_fds = realloc(io_fds, capacity * sizeof(io_fd_t *));
+        if (new_fds == NULL)
+        {
+            return NULL;
+        }
+        memset(new_fds + io_fds_capacity, 0, (capacity - io_fds_capacity) * sizeof(io_fd_t *));
+        io_fds = new_fds;
+        io_fds_capacity = capacity;
+    }
+    if (io_fds[fd] == NULL)
+    {
+        io_fds[fd] = calloc(1, sizeof(io_fd_t));
+    }
+    return io_fds[fd];
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static int io_arm(int fd, io_fd_t *record)
+{
+    // one-shot interest in every direction someone waits for; re-armed after each report
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    event.events |= (record->readers.head != NULL) ? EPOLLIN : 0;
+    event.events |= (record->writers.head != NULL) ? EPOLLOUT : 0;
+    event.data.fd = fd;
+    // the fd may be new to epoll, or a closed fd's number may have been reused
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1 &&
+        (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1))
+    {
+        return -1;
+    }
+    if (!record->armed)
+    {
+        record->armed = true;
+        io_armed++;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static int io_wait(int fd, uint32_t events)
+{
+    // park the running thread until the fd is ready in the given direction (EPOLLIN or EPOLLOUT)
+    io_fd_t *record = io_record(fd);
+    if (record == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    thread_queue_t *waiters = (events == EPOLLIN) ? &record->readers : &record->writers;
+    thread_t *self = this_worker()->current;
+    self->state = THREAD_BLOCKED;
+    self->io_fd = fd;
+    queue_push(waiters, self);
+    if (io_arm(fd, record) == -1)
+    {
+        int saved_errno = errno;
+        queue_remove(waiters, self);
+        self->io_fd = -1;
+        self->state = THREAD_RUNNING;
+        errno = saved_errno;
+        return -1;
+    }
+    schedule_next();
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void io_cancel(thread_t *thread)
+{
+    // a waiter leaves before its fd was reported: narrow the fd's interest to the remaining waiters,
+    // or drop it from epoll, so an unwatched fd does not keep the scheduler polling
+    int fd = thread->io_fd;
+    io_fd_t *record = io_fds[fd];
+    queue_remove(thread->queue, thread);
+    thread->io_fd = -1;
+    if (record->readers.head != NULL || record->writers.head != NULL)
+    {
+        io_arm(fd, record);
+    }
+    else if (record->armed)
+    {
+        // fails harmlessly if the fd was closed meanwhile, which already removed it
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        record->armed = false;
+        io_armed--;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void handle_io_events(struct epoll_event *events, int count)
+{
+    // move the waiters of every reported fd to the READY queue
+    for (int i = 0; i < count; i++)
+    {
+        int fd = events[i].data.fd;
+        // an idle wakeup: just drain it
+        if (fd == wake_fd)
+        {
+            uint64_t value;
+            ssize_t drained = read(wake_fd, &value, sizeof(value));
+            (void)drained;
+            idle_kicked = false;
+            continue;
+        }
+        io_fd_t *record = io_fds[fd];
+        // reported before an idle worker got here, but its last waiter was terminated meanwhile
+        if (!record->armed)
+        {
+            continue;
+        }
+        record->armed = false;
+        io_armed--;
+        // errors and hangups wake both directions; the retried call reports them
+        thread_t *thread;
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        {
+            while ((thread = wake_one(&record->readers)) != NULL)
+            {
+                thread->io_fd = -1;
+            }
+        }
+        if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        {
+            while ((thread = wake_one(&record->writers)) != NULL)
+            {
+                thread->io_fd = -1;
+            }
+        }
+        // one-shot: the other direction may still have waiters
+        if (record->readers.head != NULL || record->writers.head != NULL)
+        {
+            io_arm(fd, record);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void poll_io()
+{
+    // collect whatever epoll has ready without waiting
+    struct epoll_event events[IO_EVENT_BATCH];
+    int saved_errno = errno;
+    int count = epoll_wait(epoll_fd, events, IO_EVENT_BATCH, 0);
+    handle_io_events(events, count);
+    errno = saved_errno;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+    {
+        return -1;
+    }
+    if (flags & O_NONBLOCK)
+    {
+        return 0;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+ssize_t uthread_read(int fd, void *buf, size_t count)
+{
+    if (set_nonblocking(fd) == -1)
+    {
+        return -1;
+    }
+    // retry inside the critical section, so no readiness report can slip between the try and the wait
+    enter_crit_sec();
+    ssize_t result;
+    while ((result = read(fd, buf, count)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (io_wait(fd, EPOLLIN) == -1)
+        {
+            break;
+        }
+    }
+    exit_crit_sec();
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+ssize_t uthread_write(int fd, const void *buf, size_t count)
+{
+    if (set_nonblocking(fd) == -1)
+    {
+        return -1;
+    }
+    enter_crit_sec();
+    ssize_t result;
+    while ((result = write(fd, buf, count)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (io_wait(fd, EPOLLOUT) == -1)
+        {
+            break;
+        }
+    }
+    exit_crit_sec();
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    if (set_nonblocking(fd) == -1)
+    {
+        return -1;
+    }
+    enter_crit_sec();
+    int result;
+    while ((result = accept(fd, addr, addrlen)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (io_wait(fd, EPOLLIN) == -1)
+        {
+            break;
+        }
+    }
+    exit_crit_sec();
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (set_nonblocking(fd) == -1)
+    {
+        return -1;
+    }
+    enter_crit_sec();
+    int result = connect(fd, addr, addrlen);
+    // in progress --> wait until writable, then fetch the outcome
+    if (result == -1 && errno == EINPROGRESS && io_wait(fd, EPOLLOUT) == 0)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        result = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (result == 0 && error != 0)
+        {
+            errno = error;
+            result = -1;
+        }
+    }
+    exit_crit_sec();
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------//
+/* ===================================================================== */
+/*                            Blocking Calls                             */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+
+static void *offload_main(void *arg)
+{
+    (void)arg;
+    // helpers never take the library's signals
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    while (true)
+    {
+        pthread_mutex_lock(&offload_lock);
+        while (offload_head == NULL)
+        {
+            pthread_cond_wait(&offload_cond, &offload_lock);
+        }
+        offload_job_t *job = offload_head;
+        offload_head = job->next;
+        if (offload_head == NULL)
+        {
+            offload_tail = NULL;
+        }
+        pthread_mutex_unlock(&offload_lock);
+
+        errno = 0;
+        job->result = job->fn(job->arg);
+        job->error = errno;
+
+        // hand it back; the scheduler picks it up on its next switch
+        job->next = __atomic_load_n(&offload_done, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&offload_done, &job->next, job, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+        {
+        }
+        // in case every worker sleeps in idle_wait
+        uint64_t one = 1;
+        ssize_t written = write(wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool start_offload()
+{
+    // helpers are started on the first offload; partial success is enough
+    for (int i = 0; i < OFFLOAD_THREADS; i++)
+    {
+        pthread_t pthread;
+        if (pthread_create(&pthread, NULL, offload_main, NULL) != 0)
+        {
+            return i > 0;
+        }
+        pthread_detach(pthread);
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void collect_offloads()
+{
+    // finished calls make their threads READY (or are dropped if the thread is gone)
+    offload_job_t *job = __atomic_exchange_n(&offload_done, NULL, __ATOMIC_ACQUIRE);
+    while (job != NULL)
+    {
+        offload_job_t *next = job->next;
+        thread_t *thread = job->thread;
+        offload_waiting--;
+        if (thread == NULL)
+        {
+            free(job);
+        }
+        else
+        {
+            thread->offload = NULL;
+            if (!thread->blocked)
+            {
+                make_ready(thread);
+            }
+        }
+        job = next;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+void *uthread_offload(uthread_offload_fn fn, void *arg)
+{
+    // the caller's part of the shared stack is copied out while it waits, so the helper can't use it
+    if (shared_stack != NULL && (char *)arg >= shared_stack && (char *)arg < shared_stack + shared_stack_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    enter_crit_sec();
+    if (!offload_started)
+    {
+        offload_started = start_offload();
+    }
+    offload_job_t *job = offload_started ? malloc(sizeof(offload_job_t)) : NULL;
+    // no helpers --> run it here
+    if (job == NULL)
+    {
+        exit_crit_sec();
+        return fn(arg);
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->thread = this_worker()->current;
+    job->next = NULL;
+
+    pthread_mutex_lock(&offload_lock);
+    if (offload_tail != NULL)
+    {
+        offload_tail->next = job;
+    }
+    else
+    {
+        offload_head = job;
+    }
+    offload_tail = job;
+    pthread_cond_signal(&offload_cond);
+    pthread_mutex_unlock(&offload_lock);
+
+    // wait for collect_offloads
+    thread_t *self = this_worker()->current;
+    self->offload = job;
+    self->state = THREAD_BLOCKED;
+    offload_waiting++;
+    schedule_next();
+
+    void *result = job->result;
+    int error = job->error;
+    free(job);
+    exit_crit_sec();
+    errno = error;
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------//
+/* ===================================================================== */
+/*                                Tracing                                */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+
+static void trace(trace_type_t type, int tid, int arg, int flags)
+{
+    // called inside critical sections only, so start/stop can't swap the buffer under us
+    if (!tracing)
+    {
+        return;
+    }
+    unsigned long long slot = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED) & (trace_capacity - 1);
+    trace_event_t *event = &trace_buffer[slot];
+    event->ticks = stats_clock();
+    event->tid = tid;
+    event->arg = arg;
+    event->type = type;
+    event->worker = (current_worker != NULL) ? current_worker->index : -1;
+    event->flags = flags;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_trace_start(int num_events)
+{
+    // error if the buffer size isn't positive
+    if (num_events <= 0)
+    {
+        fprintf(stderr, "system error: invalid number of trace events\n");
+        return -1;
+    }
+    unsigned long long capacity = 1;
+    while (capacity < (unsigned long long)num_events)
+    {
+        capacity <<= 1;
+    }
+    trace_event_t *buffer = malloc(capacity * sizeof(trace_event_t));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "system error: failed to allocate trace buffer\n");
+        return -1;
+    }
+    enter_crit_sec();
+    trace_event_t *old = trace_buffer;
+    trace_buffer = buffer;
+    trace_capacity = capacity;
+    trace_next = 0;
+    tracing = true;
+    exit_crit_sec();
+    free(old);
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+void uthread_trace_stop()
+{
+    enter_crit_sec();
+    tracing = false;
+    exit_crit_sec();
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static const char *trace_names[] = { "spawn", "switch", "block", "resume", "sleep", "wake", "terminate", "tick" };
+
+static void trace_slice(FILE *out, bool *first, const char *name, int tid, double begin_us, double end_us, int worker)
+{
+    fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"worker\":%d}}",
+            *first ? "" : ",", name, tid, begin_us, end_us - begin_us, worker);
+    *first = false;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_trace_dump(FILE *out)
+{
+    enter_crit_sec();
+    // error if nothing was ever traced
+    if (trace_buffer == NULL || out == NULL)
+    {
+        fprintf(stderr, "system error: no trace to dump\n");
+        exit_crit_sec();
+        return -1;
+    }
+    // per thread: when the slice it is in (running or READY) began, -1 if none
+    double *run_since = malloc(thread_capacity * sizeof(double));
+    double *ready_since = malloc(thread_capacity * sizeof(double));
+    int *run_worker = malloc(thread_capacity * sizeof(int));
+    bool *seen = calloc(thread_capacity, sizeof(bool));
+    if (run_since == NULL || ready_since == NULL || run_worker == NULL || seen == NULL)
+    {
+        free(run_since);
+        free(ready_since);
+        free(run_worker);
+        free(seen);
+        fprintf(stderr, "system error: failed to allocate trace dump\n");
+        exit_crit_sec();
+        return -1;
+    }
+    for (int i = 0; i < thread_capacity; i++)
+    {
+        run_since[i] = -1;
+        ready_since[i] = -1;
+    }
+
+    // the oldest events were overwritten once the ring wrapped
+    unsigned long long end = trace_next;
+    unsigned long long begin = (end > trace_capacity) ? end - trace_capacity : 0;
+    long long now_ticks = stats_clock();
+    long long now_ns = monotonic_ns();
+    double last_us = 0;
+    bool first = true;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (unsigned long long i = begin; i < end; i++)
+    {
+        trace_event_t *event = &trace_buffer[i & (trace_capacity - 1)];
+        double us = stats_to_ns(event->ticks - init_ticks, now_ns, now_ticks) / 1000.0;
+        int tid = event->tid;
+        bool known = (tid >= 0 && tid < thread_capacity);
+        last_us = us;
+        if (known)
+        {
+            seen[tid] = true;
+        }
+
+        // running and READY slices, from the switches and the events that make a thread READY
+        if (event->type == TRACE_SWITCH)
+        {
+            if (known && run_since[tid] >= 0)
+            {
+                trace_slice(out, &first, "running", tid, run_since[tid], us, run_worker[tid]);
+            }
+            if (known)
+            {
+                run_since[tid] = -1;
+                ready_since[tid] = (event->flags & TRACE_PREV_READY) ? us : -1;
+            }
+            int next = event->arg;
+            if (next >= 0 && next < thread_capacity)
+            {
+                seen[next] = true;
+                if (ready_since[next] >= 0)
+                {
+                    trace_slice(out, &first, "ready", next, ready_since[next], us, event->worker);
+                }
+                ready_since[next] = -1;
+                run_since[next] = us;
+                run_worker[next] = event->worker;
+            }
+            continue;
+        }
+        if (known && (event->type == TRACE_SPAWN || event->type == TRACE_WAKE))
+        {
+            ready_since[tid] = us;
+        }
+        else if (known && (event->type == TRACE_BLOCK || event->type == TRACE_TERMINATE) && ready_since[tid] >= 0)
+        {
+            // taken out of the READY queue without running
+            trace_slice(out, &first, "ready", tid, ready_since[tid], us, event->worker);
+            ready_since[tid] = -1;
+        }
+
+        // everything else is an instant on the thread's track
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                "\"args\":{\"arg\":%d,\"worker\":%d,\"deferred\":%s}}",
+                first ? "" : ",", trace_names[event->type], tid, us, event->arg, event->worker,
+                (event->type == TRACE_TICK && (event->flags & TRACE_PREEMPTED)) ? "true" : "false");
+        first = false;
+    }
+
+    // slices still open end with the trace; then name the tracks
+    for (int i = 0; i < thread_capacity; i++)
+    {
+        if (run_since[i] >= 0)
+        {
+            trace_slice(out, &first, "running", i, run_since[i], last_us, run_worker[i]);
+        }
+        if (ready_since[i] >= 0)
+        {
+            trace_slice(out, &first, "ready", i, ready_since[i], last_us, -1);
+        }
+        if (seen[i])
+        {
+            fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"uthread %d\"}}",
+                    first ? "" : ",", i, i);
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    free(run_since);
+    free(ready_since);
+    free(run_worker);
+    free(seen);
+    bool failed = (fflush(out) != 0 || ferror(out));
+    exit_crit_sec();
+    if (failed)
+    {
+        fprintf(stderr, "system error: failed to write trace\n");
+        return -1;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+/* ===================================================================== */
+/*                               Profiling                               */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+
+static void take_profile_sample(worker_t *worker, ucontext_t *uc)
+{
+    // runs on whatever the worker is running; touches nothing but the sample it claims
+    int index = __atomic_fetch_add(&profile_count, 1, __ATOMIC_RELAXED);
+    if (index >= profile_capacity)
+    {
+        return;
+    }
+    profile_sample_t *sample = &profile_samples[index];
+    thread_t *current = worker->current;
+    sample->tid = (current == &worker->idle) ? -1 : current->tid;
+
+    // the stack the frames must lie in: the uthread's own, or the kernel thread's for the main
+    // thread and for idle contexts without one
+    address_t low, high;
+    if (current->stack != NULL)
+    {
+        low = (address_t)current->stack;
+        high = low + current->stack_size;
+    }
+    else
+    {
+        // (by tid: the thread table may be in the middle of a realloc)
+        worker_t *owner = (current->tid == 0) ? &workers[0] : worker;
+        low = (address_t)owner->pthread_stack;
+        high = low + owner->pthread_stack_size;
+    }
+
+    // interrupted instruction, then the return addresses along the frame pointer chain
+    address_t fp = uc->uc_mcontext.gregs[REG_RBP];
+    sample->frames[0] = (void *)uc->uc_mcontext.gregs[REG_RIP];
+    int depth = 1;
+    while (depth < PROFILE_MAX_DEPTH && fp >= low && fp + 2 * sizeof(address_t) <= high &&
+           fp % sizeof(address_t) == 0)
+    {
+        address_t next = ((address_t *)fp)[0];
+        address_t ret = ((address_t *)fp)[1];
+        if (ret == 0)
+        {
+            break;
+        }
+        sample->frames[depth++] = (void *)ret;
+        // frames only get older going up the stack
+        if (next <= fp)
+        {
+            break;
+        }
+        fp = next;
+    }
+    sample->depth = depth;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void profile_handler(int signum, siginfo_t *info, void *context)
+{
+    (void)signum;
+    (void)info;
+    // counted while it runs, so that a dump can wait for a sample that is still being written
+    __atomic_add_fetch(&profile_in_flight, 1, __ATOMIC_SEQ_CST);
+    worker_t *worker = current_worker;
+    if (worker != NULL && __atomic_load_n(&profiling, __ATOMIC_SEQ_CST))
+    {
+        // a sample held back by a tick is taken against the code the tick interrupted
+        take_profile_sample(worker, (worker->tick_context != NULL) ? worker->tick_context : (ucontext_t *)context);
+    }
+    __atomic_sub_fetch(&profile_in_flight, 1, __ATOMIC_RELEASE);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void profile_quiesce()
+{
+    // no new samples, and none still being written by a handler on another worker
+    __atomic_store_n(&profiling, false, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&profile_in_flight, __ATOMIC_ACQUIRE) != 0)
+    {
+        __builtin_ia32_pause();
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static bool find_pthread_stack(worker_t *worker)
+{
+    pthread_attr_t attr;
+    void *stack;
+    size_t stack_size;
+    if (pthread_getattr_np(worker->pthread, &attr) != 0)
+    {
+        return false;
+    }
+    int error = pthread_attr_getstack(&attr, &stack, &stack_size);
+    pthread_attr_destroy(&attr);
+    if (error != 0)
+    {
+        return false;
+    }
+    worker->pthread_stack = stack;
+    worker->pthread_stack_size = stack_size;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_profile_start(int interval_usecs, int max_samples)
+{
+    // error if the interval or the buffer size isn't positive
+    if (interval_usecs <= 0 || max_samples <= 0)
+    {
+        fprintf(stderr, "system error: invalid profiler interval or buffer size\n");
+        return -1;
+    }
+    // error if it is already running
+    if (profiling)
+    {
+        fprintf(stderr, "system error: profiler already running\n");
+        return -1;
+    }
+    profile_sample_t *buffer = malloc(max_samples * sizeof(profile_sample_t));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "system error: failed to allocate profile buffer\n");
+        return -1;
+    }
+    for (int i = 0; i < num_workers; i++)
+    {
+        // a worker started by uthread_init_ex may not have run yet
+        while (__atomic_load_n(&workers[i].kernel_tid, __ATOMIC_ACQUIRE) == 0)
+        {
+            sched_yield();
+        }
+        if (!find_pthread_stack(&workers[i]))
+        {
+            fprintf(stderr, "system error: failed to find a worker's stack\n");
+            free(buffer);
+            return -1;
+        }
+    }
+    free(profile_samples);
+    profile_samples = buffer;
+    profile_capacity = max_samples;
+    profile_count = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = profile_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    if (sigaction(SIGPROF, &sa, NULL) == -1)
+    {
+        fprintf(stderr, "system error: sigaction failed\n");
+        return -1;
+    }
+    install_tick_handler(true);
+    profiling = true;
+
+    // SIGPROF to each worker every interval of its own CPU time
+    struct itimerspec timer;
+    timer.it_value.tv_sec = interval_usecs / 1000000;
+    timer.it_value.tv_nsec = (interval_usecs % 1000000) * 1000;
+    timer.it_interval = timer.it_value;
+    for (int i = 0; i < num_workers; i++)
+    {
+        clockid_t clock;
+        struct sigevent event;
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify = SIGEV_THREAD_ID;
+        event.sigev_signo = SIGPROF;
+        event.sigev_notify_thread_id = workers[i].kernel_tid;
+        if (pthread_getcpuclockid(workers[i].pthread, &clock) != 0 ||
+            timer_create(clock, &event, &workers[i].profile_timer) == -1)
+        {
+            fprintf(stderr, "system error: timer_create failed\n");
+            exit(1);
+        }
+        if (timer_settime(workers[i].profile_timer, 0, &timer, NULL) == -1)
+        {
+            fprintf(stderr, "system error: timer_settime failed\n");
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+void uthread_profile_stop()
+{
+    if (!profiling)
+    {
+        return;
+    }
+    for (int i = 0; i < num_workers; i++)
+    {
+        timer_delete(workers[i].profile_timer);
+    }
+    profile_quiesce();
+    install_tick_handler(false);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static int compare_profile_samples(const void *a, const void *b)
+{
+    // by thread, then by stack (innermost frame last, so equal stacks end up next to each other)
+    const profile_sample_t *x = (const profile_sample_t *)a;
+    const profile_sample_t *y = (const profile_sample_t *)b;
+    if (x->tid != y->tid)
+    {
+        return (x->tid > y->tid) - (x->tid < y->tid);
+    }
+    for (int i = 0; i < x->depth && i < y->depth; i++)
+    {
+        void *fx = x->frames[x->depth - 1 - i];
+        void *fy = y->frames[y->depth - 1 - i];
+        if (fx != fy)
+        {
+            return (fx > fy) - (fx < fy);
+        }
+    }
+    return (x->depth > y->depth) - (x->depth < y->depth);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static int compare_profile_lines(const void *a, const void *b)
+{
+    return strcmp(((const profile_line_t *)a)->line, ((const profile_line_t *)b)->line);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void print_frame(FILE *out, void *address, bool return_address)
+{
+    // a return address points after the call, which may already be the next function
+    void *lookup = return_address ? (char *)address - 1 : address;
+    Dl_info info;
+    bool found = (dladdr(lookup, &info) != 0);
+    if (found && info.dli_sname != NULL)
+    {
+        fprintf(out, ";%s", info.dli_sname);
+    }
+    else if (found && info.dli_fname != NULL)
+    {
+        const char *name = strrchr(info.dli_fname, '/');
+        fprintf(out, ";%s+0x%lx", (name != NULL) ? name + 1 : info.dli_fname,
+                (unsigned long)((char *)lookup - (char *)info.dli_fbase));
+    }
+    else
+    {
+        fprintf(out, ";0x%lx", (unsigned long)lookup);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+int uthread_profile_dump(FILE *out)
+{
+    // error if there are no samples to dump
+    if (profile_samples == NULL || out == NULL)
+    {
+        fprintf(stderr, "system error: no profile to dump\n");
+        return -1;
+    }
+    // the samples are sorted in place, so the profiler pauses meanwhile
+    bool was_profiling = profiling;
+    profile_quiesce();
+    int count = (profile_count < profile_capacity) ? profile_count : profile_capacity;
+    qsort(profile_samples, count, sizeof(profile_sample_t), compare_profile_samples);
+
+    // one line per distinct stack: thread;outermost;...;innermost, first per distinct return addresses
+    profile_line_t *lines = malloc((count > 0 ? count : 1) * sizeof(profile_line_t));
+    int num_lines = 0;
+    bool failed = (lines == NULL);
+    for (int i = 0; i < count && !failed;)
+    {
+        int j = i + 1;
+        while (j < count && compare_profile_samples(&profile_samples[i], &profile_samples[j]) == 0)
+        {
+            j++;
+        }
+        profile_sample_t *sample = &profile_samples[i];
+        char *line = NULL;
+        size_t length;
+        FILE *stream = open_memstream(&line, &length);
+        if (stream == NULL)
+        {
+            failed = true;
+            break;
+        }
+        if (sample->tid == -1)
+        {
+            fprintf(stream, "idle");
+        }
+        else
+        {
+            fprintf(stream, "uthread %d", sample->tid);
+        }
+        for (int k = sample->depth - 1; k >= 0; k--)
+        {
+            print_frame(stream, sample->frames[k], k > 0);
+        }
+        if (fclose(stream) != 0)
+        {
+            free(line);
+            failed = true;
+            break;
+        }
+        lines[num_lines].line = line;
+        lines[num_lines].count = j - i;
+        num_lines++;
+        i = j;
+    }
+
+    // different return addresses (e.g. two calls from one function) may print the same: merge by text
+    if (!failed)
+    {
+        qsort(lines, num_lines, sizeof(profile_line_t), compare_profile_lines);
+    }
+    for (int i = 0; i < num_lines;)
+    {
+        int samples = 0;
+        int j = i;
+        while (j < num_lines && strcmp(lines[i].line, lines[j].line) == 0)
+        {
+            samples += lines[j++].count;
+        }
+        if (!failed)
+        {
+            fprintf(out, "%s %d\n", lines[i].line, samples);
+        }
+        while (i < j)
+        {
+            free(lines[i++].line);
+        }
+    }
+    free(lines);
+
+    // samples that didn't fit are reported to the caller, not guessed at
+    int dropped = (profile_count > profile_capacity) ? profile_count - profile_capacity : 0;
+    // the sorted samples are kept, and new ones are appended after them
+    __atomic_store_n(&profiling, was_profiling, __ATOMIC_SEQ_CST);
+    failed = (failed || fflush(out) != 0 || ferror(out));
+    if (failed)
+    {
+        fprintf(stderr, "system error: failed to write profile\n");
+        return -1;
+    }
+    return dropped;
+}
+
+//--------------------------------------------------------------------------------------------------//
+/* ===================================================================== */
+/*              Internal Helper Functions and Structures                 */
+/* ===================================================================== */
+/*
+ * The following declarations are intended for internal use by the thread library.
+ * They provide guidance on how to structure your implementation using sigsetjmp/siglongjmp
+ * and manually managed stacks.
+ */
+//--------------------------------------------------------------------------------------------------//
+
+void schedule_next(void)
+{
+    enter_crit_sec();
+    worker_t *worker = this_worker();
+    thread_t *prev = worker->current;
+    // consumed here, since the thread that runs next on this worker may not return through quantum_expired
+    bool ticking = worker->ticking;
+    worker->ticking = false;
+
+    // threads whose fds became ready or whose offloaded calls finished, and timed sleepers that are due,
+    // join the READY queue ahead of the preempted thread
+    if (io_armed > 0)
+    {
+        poll_io();
+    }
+    if (__atomic_load_n(&offload_done, __ATOMIC_RELAXED) != NULL)
+    {
+        collect_offloads();
+    }
+    if (deadline_heap.size > 0)
+    {
+        wake_timed_sleepers();
+    }
+
+    // the policy accounts for the time prev ran
+    worker->switch_ticks = stats_clock();
+    if (sched->put_prev != NULL)
+    {
+        sched->put_prev(worker->index, (prev != &worker->idle) ? prev : NULL);
+    }
+
+    // a thread that is still running goes back to the policy (the end of the READY queue for round robbin)
+    if (prev->state == THREAD_RUNNING && prev != &worker->idle)
+    {
+        make_ready(prev);
+    }
+    // a terminated thread is reaped by whoever runs next on this worker
+    else if (prev->state == THREAD_TERMINATED)
+    {
+        worker->zombie_tid = prev->tid;
+    }
+
+    // next thread is whoever waited longest
+    thread_t *next = sched->pick_next(worker->index);
+
+    // nothing ready --> the worker goes idle (or stays idle)
+    if (next == NULL)
+    {
+        if (prev == &worker->idle)
+        {
+            exit_crit_sec();
+            return;
+        }
+        next = &worker->idle;
+    }
+    // a worker leaving idle passes the wakeup on while there is more work, since a single kick_idle
+    // wakes a single worker however many threads became READY
+    else if (prev == &worker->idle && num_workers > 1 && work_pending())
+    {
+        kick_idle();
+    }
+    // under MLFQ every thread switched in (even the same one again) starts a full quantum, or one switched in
+    // mid-period would be cut early and sink a level. A tick's period has just begun, so only a switch in the
+    // middle of one restarts the timer (update_timer reprograms a timer of an unknown period); otherwise it is
+    // reprogrammed only if next's quantum differs
+    if (sched == &mlfq_ops && next != &worker->idle && !ticking)
+    {
+        worker->timer_usecs = -1;
+    }
+
+    run_next(worker, prev, next);
+    exit_crit_sec();
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void run_next(worker_t *worker, thread_t *prev, thread_t *next)
+{
+    // statistics: prev ran until now, next waited until now (the time the switch started at)
+    long long now = worker->switch_ticks;
+    if (prev != &worker->idle)
+    {
+        prev->run_ticks += now - prev->state_since;
+        prev->state_since = now;
+    }
+    if (next != &worker->idle)
+    {
+        long long waited = now - next->state_since;
+        next->ready_ticks += waited;
+        if (waited > next->max_ready_ticks)
+        {
+            next->max_ready_ticks = waited;
+        }
+        next->state_since = now;
+    }
+    if (next != prev)
+    {
+        worker->switches++;
+        if (tracing)
+        {
+            int flags = (worker->preempting ? TRACE_PREEMPTED : 0) |
+                        (prev->state == THREAD_READY ? TRACE_PREV_READY : 0);
+            trace(TRACE_SWITCH, prev->tid, next->tid, flags);
+        }
+        if (prev != &worker->idle && worker->preempting && prev->state == THREAD_READY)
+        {
+            prev->involuntary_switches++;
+        }
+        else if (prev != &worker->idle)
+        {
+            prev->voluntary_switches++;
+        }
+    }
+
+    // scheduule next
+    worker->current = next;
+    next->state = THREAD_RUNNING;
+    next->worker = worker->index;
+    update_timer(worker);
+
+    if (next != prev)
+    {
+        // the scheduler lock (if any) is handed over to the next thread together with the worker;
+        // we may come back on a different worker
+        prev->worker = -1;
+        context_switch(prev, next);
+        reap_zombie();
+    }
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+void context_switch(thread_t *current, thread_t *next)
+{
+    // shared stack: next's contents go back in place first, once the owner's are saved; if we are the
+    // owner, we are running on it, so the copier does that on its own stack and then switches to next
+    if (shared_stack != NULL && is_shared(next) && stack_owner != next)
+    {
+        if (is_shared(current))
+        {
+            copy_target = next;
+            next = &stack_copier;
+        }
+        else
+        {
+            swap_shared_stack(next);
+        }
+    }
+
+#ifdef UTHREAD_SWITCH_ASM
+    // Save current thread context and jump to the next one; returns when we are switched back in
+    switch_stacks(&current->sp, next->sp);
+#else
+    // Save current thread context
+    // (critical sections never change the signal mask, so there is no mask to save)
+    asm volatile("mov %%rsp, %0" : "=r"(current->stack_sp));
+    int ret_val = sigsetjmp(current->env, 0);
+
+    if (ret_val == 0)
+    {
+        // First time --> jump to next thread
+        siglongjmp(next->env, 1);
+    }
+    // When we return here (ret_val != 0), this thread is being resumed
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void quantum_expired(bool preempted)
+{
+    enter_crit_sec();
+    worker_t *worker = this_worker();
+    thread_t *current = worker->current;
+    if (preempted)
+    {
+        trace(TRACE_TICK, current->tid, -1, worker->resched_pending ? TRACE_PREEMPTED : 0);
+    }
+    worker->resched_pending = 0;
+    worker->kick_pending = 0;
+
+    // updates global quantum counters
+    total_quantums++;
+
+    // Increments current thread's quantum count
+    if (current != &worker->idle)
+    {
+        current->quantums++;
+    }
+
+    // let the policy adjust priorities
+    if (sched->tick != NULL)
+    {
+        sched->tick(worker->index, (current != &worker->idle) ? current : NULL, preempted);
+    }
+
+    // Sleepers whose time is up go to the end of the READY queue
+    wake_sleepers();
+
+    // Quantum expired --> schedule next (moves the current thread to the end of the READY queue)
+    worker->preempting = preempted;
+    worker->ticking = preempted;
+    schedule_next();
+    this_worker()->preempting = false;
+
+    exit_crit_sec();
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+void timer_handler(int signum)
+{
+    worker_t *worker = this_worker();
+    // not one of our workers
+    if (worker == NULL)
+    {
+        return;
+    }
+
+    // inside a critical section --> defer the tick until the outermost one exits
+    if (worker->current->preempt_disable)
+    {
+        worker->resched_pending = 1;
+        worker->ticks_deferred++;
+        return;
+    }
+    worker->ticks_taken++;
+    int saved_errno = errno;
+    quantum_expired(true);
+    errno = saved_errno;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void tick_handler(int signum, siginfo_t *info, void *context)
+{
+    (void)info;
+    worker_t *worker = this_worker();
+    // take a sample the tick held back (see install_tick_handler) against the code the tick interrupted,
+    // and unblock SIGPROF again before any switch, unless that code had it blocked itself
+    ucontext_t *uc = (ucontext_t *)context;
+    if (worker != NULL && profile_holds_ticks && !sigismember(&uc->uc_sigmask, SIGPROF))
+    {
+        worker->tick_context = uc;
+        sigset_t samples;
+        sigemptyset(&samples);
+        sigaddset(&samples, SIGPROF);
+        pthread_sigmask(SIG_UNBLOCK, &samples, NULL);
+        worker->tick_context = NULL;
+    }
+    timer_handler(signum);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void install_tick_handler(bool hold_samples)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = tick_handler;
+    sigemptyset(&sa.sa_mask);
+    // while profiling, a sample due at the same kernel tick as a tick would otherwise interrupt
+    // tick_handler before its first instruction, when nothing tells it where the tick's frame is
+    if (hold_samples)
+    {
+        sigaddset(&sa.sa_mask, SIGPROF);
+    }
+    // SIGVTALRM stays unblocked inside the handler, so switching away from it never leaves the
+    // signal masked for the next thread; a nested tick just finds preemption disabled.
+    sa.sa_flags = SA_NODEFER | SA_SIGINFO;
+    if (sigaction(SIGVTALRM, &sa, NULL) == -1)
+    {
+        fprintf(stderr, "system error: sigaction failed\n");
+        exit(1);
+    }
+    profile_holds_ticks = hold_samples;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void kicked()
+{
+    enter_crit_sec();
+    worker_t *worker = this_worker();
+    worker->kick_pending = 0;
+    // timed sleepers that are due preempt the running thread
+    int sleepers = deadline_heap.size;
+    wake_timed_sleepers();
+    bool woke = (deadline_heap.size < sleepers);
+    // the running thread was blocked or terminated from another worker: switch away from it, without
+    // ending a quantum (a thread still running was switched away from before the kick arrived)
+    if (worker->current != &worker->idle && (worker->current->state != THREAD_RUNNING || woke))
+    {
+        worker->preempting = woke;
+        schedule_next();
+        this_worker()->preempting = false;
+    }
+    exit_crit_sec();
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void kick_handler(int signum)
+{
+    (void)signum;
+    worker_t *worker = this_worker();
+    // not one of our workers
+    if (worker == NULL)
+    {
+        return;
+    }
+
+    // inside a critical section --> defer the kick until the outermost one exits
+    if (worker->current->preempt_disable)
+    {
+        worker->kick_pending = 1;
+        return;
+    }
+    int saved_errno = errno;
+    kicked();
+    errno = saved_errno;
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+void setup_thread(int tid, char *stack, thread_entry_point entry_point)
+{
+    // fill the stack with the pattern whose first overwritten word gives the thread's stack usage
+    thread_t *thread = threads[tid];
+    thread->stack_peak = 0;
+    if (measure_stacks && !is_shared(thread))
+    {
+        memset(stack, STACK_FILL_BYTE, thread->stack_size);
+    }
+    init_context(thread, stack, thread->stack_size, thread_wrapper);
+}
+
+//--------------------------------------------------------------------------------------------------//
+
+static void init_context(thread_t *thread, char *stack, size_t stack_size, void (*start)(void))
+{
+#ifdef UTHREAD_SWITCH_ASM
+    // 16-byte aligned frame at the top of the stack, so the start function begins with an ABI-aligned stack
+    address_t top = ((address_t)(stack + stack_size)) & ~(address_t)15;
+    switch_frame_t initial;
+    memset(&initial, 0, sizeof(initial));
+
+    // inherit the current floating point control state
+    asm volatile("fnstcw %0" : "=m"(initial.fpu_cw));
+    asm volatile("stmxcsr %0" : "=m"(initial.mxcsr));
+    initial.ret = (address_t)(start);
+    char *frame = (char *)(top - sizeof(switch_frame_t));
+    thread->sp = frame;
+#else
+    char *frame = stack + stack_size - sizeof(address_t);
+    address_t pc = (address_t)(start);
+
+    // Saves the current context
+    sigsetjmp(thread->env, 0);
 
     // Sets the stack pointer and the program counter
-    threads[tid].env->__jmpbuf[JB_SP] = translate_address(sp);
-    threads[tid].env->__jmpbuf[JB_PC] = translate_address(pc);
-    sigemptyset(&threads[tid].env->__saved_mask);
+    thread->env->__jmpbuf[JB_SP] = translate_address((address_t)frame);
+    thread->env->__jmpbuf[JB_PC] = translate_address(pc);
+    thread->stack_sp = frame;
+#endif
+
+    // the shared stack may hold another thread's contents: the frame waits in the stack copy
+    char *place = frame;
+    if (is_shared(thread))
+    {
+        thread->stack_copy_size = (stack + stack_size) - frame;
+        thread->stack_peak = thread->stack_copy_size;
+        memset(thread->stack_copy, 0, thread->stack_copy_size);
+        place = thread->stack_copy;
+    }
+#ifdef UTHREAD_SWITCH_ASM
+    memcpy(place, &initial, sizeof(initial));
+#else
+    (void)place;
+#endif
 }
 
 //---------------------------------------------End of File--------------------------------------------------------//
@@ -8,19 +8,59 @@
 #include <setjmp.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 /* ===================================================================== */
 /*                           Static Constants                            */
 /* ===================================================================== */
 
-/** Maximum number of threads (including the main thread). */
-#define MAX_THREAD_NUM 100
+/** Initial capacity of the thread table (including the main thread); the table grows as needed. */
+#define INITIAL_THREAD_NUM 100
 
-/** Stack size per thread (in bytes). */
-#define STACK_SIZE 4096
+/** Default stack size per thread (in bytes), used when no stack size attribute is given. */
+#define STACK_SIZE (64 * 1024)
+
+/** Default size of the run stack in shared-stack mode (see uthread_init_attr_t.shared_stack). */
+#define SHARED_STACK_SIZE (1024 * 1024)
+
+/** Smallest stack the library hands out; raised at init if the CPU's signal frame needs more. */
+#define MIN_STACK_SIZE (16 * 1024)
+
+/** Number of stack size classes kept by the stack pool (class i holds stacks of 2^i pages). */
+#define STACK_POOL_CLASSES 32
+
+/** Maximum number of epoll events the scheduler handles per poll. */
+#define IO_EVENT_BATCH 64
+
+/** Number of priority levels of the MLFQ policy (level 0 is the highest). */
+#define MLFQ_LEVELS 4
+
+/** Under the MLFQ policy, every thread returns to its priority level once per this many quantums. */
+#define MLFQ_BOOST_INTERVAL 100
+
+/** Weight of a thread under the fair policy unless set with uthread_set_weight. */
+#define FAIR_DEFAULT_WEIGHT 1024
+
+/** Deepest call stack the profiler records per sample (deeper frames are cut off). */
+#define PROFILE_MAX_DEPTH 32
+
+/** Number of helper kernel threads that run uthread_offload calls (started on first use). */
+#define OFFLOAD_THREADS 4
+
+/**
+ * Context switch implementation. On x86_64 a hand-written routine saves only the callee-saved
+ * registers, the stack pointer and the MXCSR/x87 control words. Define UTHREAD_SWITCH_SIGSETJMP
+ * to fall back to sigsetjmp/siglongjmp instead.
+ */
+#if defined(__x86_64__) && !defined(UTHREAD_SWITCH_SIGSETJMP)
+#define UTHREAD_SWITCH_ASM
+#endif
 
 /**
  * @brief Function pointer type for a thread's entry point.
@@ -28,6 +68,56 @@
  * Each thread's entry function must take no arguments and return void.
  */
 typedef void (*thread_entry_point)(void);
+
+/**
+ * @brief Attributes for uthread_spawn_ex.
+ */
+typedef struct {
+    size_t stack_size;          /**< Usable stack size in bytes (0 for STACK_SIZE); at least MIN_STACK_SIZE, rounded up to a power-of-two number of pages. */
+    int quantum_usecs;          /**< Length of the thread's quantums in microseconds (0 for the library's quantum). */
+} uthread_attr_t;
+
+/**
+ * @brief Scheduling policies for uthread_init_ex.
+ */
+typedef enum {
+    UTHREAD_SCHED_RR,           /**< Round robin over a single READY queue (the default). */
+    UTHREAD_SCHED_MLFQ,         /**< Multi-level feedback queue; see uthread_set_priority. */
+    UTHREAD_SCHED_FAIR          /**< Lowest weighted CPU time first; see uthread_set_weight. */
+} uthread_sched_policy_t;
+
+/**
+ * @brief Scheduling policy operations, for plugging a custom policy into uthread_init_ex.
+ *
+ * The policy owns the READY threads: the library hands it every thread that becomes READY and asks it
+ * which one to run next. All operations are called inside the library's critical section (under the
+ * scheduler lock with several workers), so they must not call the library. worker is the index of the
+ * worker making the call. enqueue, dequeue, pick_next and has_ready are required.
+ */
+struct thread;
+typedef struct uthread_sched_ops {
+    void (*enqueue)(int worker, struct thread *thread, bool next); /**< thread became READY; next asks for it to run before the others. */
+    void (*dequeue)(struct thread *thread); /**< Remove a READY thread (it is being blocked or terminated). */
+    struct thread *(*pick_next)(int worker); /**< Remove and return the thread worker runs next (NULL to go idle). */
+    bool (*has_ready)(int worker); /**< True if pick_next(worker) would return a thread. */
+    void (*tick)(int worker, struct thread *current, bool preempted); /**< A quantum ended (optional); current is NULL on an idle worker, preempted if the timer cut it. */
+    void (*put_prev)(int worker, struct thread *thread); /**< worker switches away from thread (optional); thread is NULL for the idle context, and is enqueued next if still running. */
+} uthread_sched_ops_t;
+
+/**
+ * @brief Attributes for uthread_init_ex.
+ */
+typedef struct {
+    int num_workers;            /**< Number of kernel threads running uthreads (0 or 1 for the classic single kernel thread). */
+    bool cooperative;           /**< No timer: threads switch only at yield, block, sleep and termination. */
+    bool tickless;              /**< Stop a worker's timer while its running thread has nobody to be preempted for. */
+    uthread_sched_policy_t policy; /**< Scheduling policy (UTHREAD_SCHED_RR by default). */
+    const uthread_sched_ops_t *sched_ops; /**< Custom scheduling policy, overriding policy (NULL for none). */
+    bool shared_stack;          /**< Run all spawned threads on one shared stack, copying each one's used part in and out (needs a single worker). */
+    size_t shared_stack_size;   /**< Size of the shared stack in bytes (0 for SHARED_STACK_SIZE). */
+    bool measure_stacks;        /**< Fill spawned stacks with a pattern, so uthread_get_stack_usage can measure them. */
+    bool adaptive_stacks;       /**< Size stacks from the usage learned per entry point (implies measure_stacks). */
+} uthread_init_attr_t;
 //--------------------------------------------------------------------------------------------------//
 /* ===================================================================== */
 /*                        Internal Data Structures                       */
@@ -50,14 +140,63 @@ typedef enum {
  * Each thread (except for the main thread) has its own allocated stack and context.
  * The TCB stores all metadata required for managing the thread.
  */
-typedef struct {
+typedef struct thread {
     int tid;                    /**< Unique thread identifier. */
     thread_state_t state;       /**< Current thread state. */
+#ifdef UTHREAD_SWITCH_ASM
+    void *sp;                   /**< Saved stack pointer; the rest of the context is pushed on the thread's stack. */
+#else
     sigjmp_buf env;             /**< Jump buffer for context switching using sigsetjmp/siglongjmp. */
+#endif
     int quantums;               /**< Count of quantums this thread has executed. */
     int sleep_until;            /**< Global quantum count until which the thread should sleep (0 if not sleeping). */
+    long long sleep_deadline;   /**< CLOCK_MONOTONIC time in ns at which a timed sleep ends (0 if not in one). */
+    int heap_index;             /**< Position of the thread in its sleep heap or the fair policy's heap (-1 if in neither). */
+    bool blocked;               /**< True if the thread was blocked with uthread_block (independent of sleeping). */
     thread_entry_point entry;   /**< Entry point function for the thread. */
+    char *stack;                /**< Lowest usable address of the thread's stack (NULL for the main thread). */
+    size_t stack_size;          /**< Usable size of the thread's stack in bytes (excluding the guard page). */
+    char *stack_copy;           /**< Shared-stack mode: the used part of the thread's stack while it is off the shared stack. */
+    size_t stack_copy_size;     /**< Number of bytes in stack_copy (the top of the stack down to the saved stack pointer). */
+    size_t stack_copy_capacity; /**< Allocated size of stack_copy. */
+    size_t stack_peak;          /**< Shared-stack mode: largest stack_copy_size so far (the thread's stack usage). */
+#ifndef UTHREAD_SWITCH_ASM
+    char *stack_sp;             /**< Stack pointer at the last switch away from the thread (the one in env is mangled). */
+#endif
+    int quantum_usecs;          /**< Quantum length of the thread in microseconds (0 for the library's quantum). */
+    int priority;               /**< Priority set with uthread_set_priority (0 is the highest). */
+    int level;                  /**< Current MLFQ level (always 0 under round robin). */
+    int boost_epoch;            /**< MLFQ boost the level was last reset by. */
+    int weight;                 /**< Weight under the fair policy (FAIR_DEFAULT_WEIGHT unless set with uthread_set_weight). */
+    long long vruntime;         /**< Virtual runtime under the fair policy: time running in ns scaled by FAIR_DEFAULT_WEIGHT / weight. */
+    long long state_since;      /**< Stats clock time the thread last started or stopped running or became READY (0 before it was first READY). */
+    long long run_ticks;        /**< Time spent running, in stats clock ticks. */
+    long long ready_ticks;      /**< Time spent READY, in stats clock ticks. */
+    long long max_ready_ticks;  /**< Longest single wait while READY, in stats clock ticks. */
+    long long blocked_ticks;    /**< Time spent BLOCKED (blocked, sleeping or waiting), in stats clock ticks. */
+    long long voluntary_switches;   /**< Times the thread gave up the CPU itself. */
+    long long involuntary_switches; /**< Times the thread was preempted by the timer. */
+    volatile sig_atomic_t preempt_disable; /**< Critical section nesting depth of the thread (preemption is off while nonzero). */
+    int worker;                 /**< Index of the worker the thread is running on (-1 if not running). */
+    struct thread_queue *queue; /**< Queue the thread is linked into (NULL if none). */
+    struct chan_waiter *chan_waiters; /**< Waiter records of a pending channel operation or select (NULL if none). */
+    int num_chan_waiters;       /**< Number of records in chan_waiters. */
+    struct offload_job *offload; /**< Call the thread waits for in uthread_offload (NULL if none). */
+    int io_fd;                  /**< fd the thread waits on in a uthread I/O call (-1 if none). */
+    struct thread *next;        /**< Next thread in the queue this thread is linked into (NULL if last). */
+    struct thread *prev;        /**< Previous thread in the queue this thread is linked into (NULL if first). */
 } thread_t;
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Intrusive FIFO queue of threads.
+ *
+ * Threads are linked through their own next/prev fields, so pushing, popping and removing
+ * a thread never allocates and costs O(1). A thread is linked into at most one queue at a time.
+ */
+typedef struct thread_queue {
+    thread_t *head;             /**< First thread in the queue (next to be popped). */
+    thread_t *tail;             /**< Last thread in the queue (most recently pushed). */
+} thread_queue_t;
 
 /* ===================================================================== */
 /*                           External Interface                          */
@@ -75,25 +214,99 @@ typedef struct {
  */
 int uthread_init(int quantum_usecs);
 //--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Initializes the user-level thread library with the given attributes.
+ *
+ * Same as uthread_init. With attr->num_workers = K > 1, uthreads are multiplexed over K kernel threads
+ * (M:N scheduling): the calling thread becomes worker 0 and K - 1 pthread workers are started. Each worker
+ * has its own READY queue and its own quantum timer on its CPU time, and idle workers steal READY threads
+ * from the others. All library state is protected by a single scheduler lock taken by the library's
+ * critical sections, so the API works the same from any worker. That lock serializes every library call
+ * and every switch across all workers: uthread code runs in parallel between library calls, but workloads
+ * that switch, block or lock often do not scale with K. A worker whose running thread is blocked or
+ * terminated from another worker is told with SIGURG, which the library then handles.
+ *
+ * Note that with K > 1 a uthread may resume on a different kernel thread after any preemption, so it must
+ * not rely on kernel-thread-local state (pthread_self, thread-local variables, errno across a preemption).
+ *
+ * @param quantum_usecs Length of a quantum in microseconds (must be positive).
+ * @param attr Library attributes, or NULL for the defaults.
+ * @return 0 on success; -1 on error (e.g., if quantum_usecs is non-positive).
+ */
+int uthread_init_ex(int quantum_usecs, const uthread_init_attr_t *attr);
+//--------------------------------------------------------------------------------------------------//
+/*
+ * Cooperative mode (attr->cooperative): no timer is armed and no SIGVTALRM is ever taken, so with a single
+ * worker the library's critical sections cost nothing. A quantum then ends only when the running thread
+ * calls uthread_yield (or while a worker is idle, once per quantum of wall time), and sleeps are counted
+ * in those quantums.
+ *
+ * Tickless mode (attr->tickless): a worker's timer is disarmed while the thread it runs could not be
+ * preempted in favor of anyone, i.e. while the worker's READY queue is empty and no thread sleeps, waits on
+ * I/O or waits for an offloaded call. It is re-armed as soon as a thread is made READY on that worker.
+ * Quantums then only pass while there is something to switch to, so a thread running alone does not
+ * accumulate quantums.
+ *
+ * In every preemptive mode the timer runs with the running thread's own quantum length (see
+ * uthread_attr_t and uthread_set_quantum). The timer is only reprogrammed when that length changes, so a
+ * thread switched in mid-quantum runs for the rest of the current period, except under MLFQ, where every
+ * thread the scheduler switches in starts a full quantum.
+ *
+ * Shared-stack mode (attr->shared_stack, single worker only): every spawned thread runs on one shared stack
+ * of attr->shared_stack_size bytes instead of a stack of its own, and the stack_size attribute is ignored.
+ * A thread switched out keeps only the used part of its stack, from its stack pointer up to the top, in a
+ * heap buffer sized to fit, and that part is copied back before it runs again. Memory then grows with what
+ * threads actually use rather than with their number, for the price of a copy per switch between two such
+ * threads. While a thread is switched out its stack locals are not in place: other threads must not use
+ * pointers to them (channel operations are safe; the library copies what it shares). The main thread keeps
+ * the process stack.
+ *
+ * Stack measurement (attr->measure_stacks): each spawned stack is filled with a byte pattern before the
+ * thread starts, and uthread_get_stack_usage finds the deepest word overwritten since. The fill touches
+ * every page of the stack, so stacks stay resident in full. Threads on the shared stack are always measured,
+ * by their depth whenever they are switched out (calls that return before a switch are not seen).
+ *
+ * Adaptive stacks (attr->adaptive_stacks): when a thread terminates, its stack usage is recorded against
+ * the thread's entry point, keeping the largest. Later spawns of that entry point without a stack_size
+ * attribute get twice that usage (at least MIN_STACK_SIZE, rounded up to a power-of-two number of pages)
+ * instead of STACK_SIZE. Entry points that run deeper than they ever have before can then hit the guard
+ * page; give those an explicit stack_size.
+ */
+//--------------------------------------------------------------------------------------------------//
 /**
  * @brief Creates a new thread.
  *
- * Allocates a new TCB and separate stack for the thread (using a char array).
- * The thread is added to the end of the READY queue.
- * Calling this function with a NULL entry_point or exceeding MAX_THREAD_NUM is an error.
+ * Allocates a new TCB and a STACK_SIZE stack for the thread from the stack pool.
+ * The new thread gets the lowest tid not used by an existing thread, and is added to the end of the READY queue.
+ * There is no fixed thread limit: the thread table grows as needed.
+ * Calling this function with a NULL entry_point, or running out of memory, is an error.
  *
  * @param entry_point Pointer to the thread’s entry function (must not be NULL).
  * @return On success, returns the new thread’s ID; on failure, returns -1.
  */
 int uthread_spawn(thread_entry_point entry_point);
 //--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Creates a new thread with the given attributes.
+ *
+ * Same as uthread_spawn, but the stack size is taken from attr. Stacks are mmap'ed regions with a
+ * PROT_NONE guard page below them, so an overflow faults instead of corrupting another thread.
+ * Stacks of terminated threads are kept in a pool and reused, so spawning usually makes no system call.
+ *
+ * @param entry_point Pointer to the thread’s entry function (must not be NULL).
+ * @param attr Thread attributes, or NULL for the defaults.
+ * @return On success, returns the new thread’s ID; on failure, returns -1.
+ */
+int uthread_spawn_ex(thread_entry_point entry_point, const uthread_attr_t *attr);
+//--------------------------------------------------------------------------------------------------//
 /**
  * @brief Terminates a thread.
  *
  * Terminates the thread with the specified tid and releases all resources allocated for it.
  * The thread is removed from all scheduling structures. If no thread with the given tid exists,
  * it is considered an error. Terminating the main thread (tid == 0) will terminate the entire process
- * (after releasing allocated resources).
+ * (after releasing allocated resources). A thread that terminates itself (or returns from its entry
+ * function) is reaped right after the switch away from it, so its tid and stack are reused as well.
  *
  * @param tid Thread ID to terminate.
  * @return 0 on success; -1 on error. (Note: if a thread terminates itself or if the main thread terminates,
@@ -118,6 +331,7 @@ int uthread_block(int tid);
  * @brief Resumes a blocked thread.
  *
  * Moves a thread from the BLOCKED state to the READY state.
+ * A thread that is also sleeping stays BLOCKED until its sleep period expires.
  * If the thread is already in RUNNING or READY state, this call has no effect.
  * It is an error if no thread with the given tid exists.
  *
@@ -131,14 +345,153 @@ int uthread_resume(int tid);
  *
  * Blocks the currently running thread for a specified number of quantums.
  * The current quantum is not counted; sleeping begins with the next quantum.
- * After the sleep period expires, the thread is moved to the end of the READY queue.
- * It is an error for the main thread (tid == 0) to call this function.
+ * After the sleep period expires, the thread is moved to the end of the READY queue
+ * (unless it was also blocked with uthread_block, in which case it waits for uthread_resume).
+ * While no thread at all is runnable the process sleeps instead of spinning, and that wall time is
+ * counted as quantums so that sleepers still wake on time.
+ * It is an error for the main thread (tid == 0) to call this function, or to pass a negative num_quantums.
  *
  * @param num_quantums Number of quantums to sleep.
  * @return 0 on success; -1 on error.
  */
 int uthread_sleep(int num_quantums);
 //--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Puts the running thread to sleep for a wall-clock duration.
+ *
+ * Same as uthread_sleep_until with a deadline usecs microseconds from now on CLOCK_MONOTONIC.
+ *
+ * @param usecs Number of microseconds to sleep (must not be negative).
+ * @return 0 on success; -1 on error.
+ */
+int uthread_sleep_usec(long usecs);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Puts the running thread to sleep until an absolute CLOCK_MONOTONIC time.
+ *
+ * Unlike uthread_sleep the time is wall-clock time, independent of quantums. The thread is BLOCKED until
+ * the deadline and then moved to the end of the READY queue: a timer armed for the earliest deadline
+ * preempts whatever runs when it passes, without ending its quantum, so sleeps are as short as asked even
+ * under long quantums. In cooperative mode there are no signals, and the thread is moved at the first
+ * switch after its deadline instead. A deadline in the past returns at once.
+ * Resuming and terminating a sleeping thread work as for uthread_sleep.
+ * It is an error for the main thread (tid == 0) to call this function.
+ *
+ * @param deadline Absolute time on CLOCK_MONOTONIC.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_sleep_until(const struct timespec *deadline);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Gives up the CPU.
+ *
+ * Ends the running thread's quantum as if it had expired: the total and per-thread quantum counts are
+ * incremented, expired sleepers are woken, and the thread is moved to the end of the READY queue.
+ * If no other thread is READY, the calling thread keeps running in a new quantum.
+ *
+ * @return 0 on success.
+ */
+int uthread_yield();
+//--------------------------------------------------------------------------------------------------//
+/*
+ * Direct handoff: uthread_switch_to and uthread_switch_to_block switch straight to a given thread, skipping
+ * the scheduler's pick, so a producer that just filled a buffer can run its consumer in a single switch.
+ * The target runs right away if it is READY (it is taken out of the READY queue), or if it is BLOCKED with
+ * uthread_block and not also sleeping or waiting (it is resumed). Otherwise, e.g. when it runs on another
+ * worker or waits on a mutex, the caller gives up the CPU through the scheduler as usual.
+ *
+ * Quantum accounting: a handoff does not end the quantum. No quantum counts are incremented and no quantum
+ * sleepers are woken; the target runs out the rest of the caller's quantum (the timer keeps running,
+ * unless the target's quantum length differs, in which case it starts a full quantum of its own), and the
+ * quantum is counted for whichever thread runs when it ends. So a ping-pong between two threads can't
+ * starve the others: every quantum still ends in a regular switch. Under MLFQ neither thread changes level
+ * at a handoff, and under the fair policy the caller is charged the time it ran, as at any switch.
+ */
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Gives up the CPU to a given thread.
+ *
+ * The calling thread moves to the end of the READY queue and tid runs next (see Direct handoff above).
+ * It is an error if no thread with the given tid exists or if tid is the calling thread.
+ *
+ * @param tid Thread ID of the thread to run.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_switch_to(int tid);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Blocks the calling thread and gives up the CPU to a given thread.
+ *
+ * Like uthread_switch_to, but the calling thread is BLOCKED as with uthread_block until uthread_resume is
+ * called for it, or until another thread switches to it with uthread_switch_to or uthread_switch_to_block.
+ * Two threads calling this for each other run as symmetric coroutines.
+ * It is an error if no thread with the given tid exists, if tid is the calling thread, or if the calling
+ * thread is the main thread (tid == 0).
+ *
+ * @param tid Thread ID of the thread to run.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_switch_to_block(int tid);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Sets the quantum length of a thread.
+ *
+ * The thread's quantums last quantum_usecs microseconds of CPU time from its next switch in on
+ * (immediately if it is the caller). A value of 0 restores the library's quantum length.
+ * It is an error if no thread with the given tid exists or if quantum_usecs is negative.
+ *
+ * @param tid Thread ID.
+ * @param quantum_usecs Quantum length in microseconds, or 0.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_set_quantum(int tid, int quantum_usecs);
+//--------------------------------------------------------------------------------------------------//
+/*
+ * MLFQ policy (attr->policy = UTHREAD_SCHED_MLFQ): READY threads are queued by level, 0 to MLFQ_LEVELS - 1,
+ * and the scheduler always runs the longest waiter of the highest non-empty level. A thread on level L
+ * gets quantums 2^L times as long as its base quantum, counted from each time it is scheduled. A thread
+ * whose quantum is cut by the timer sinks one level, while one that yields, blocks or sleeps before that
+ * keeps its level. So interactive threads
+ * stay on top and CPU-bound ones sink to long quantums at the bottom. Every MLFQ_BOOST_INTERVAL quantums
+ * all threads return to the level of their priority, so nobody starves. New threads start on level 0.
+ */
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Sets the priority of a thread.
+ *
+ * Under the MLFQ policy the priority is the highest level the thread runs on: it is moved there right
+ * away and returns there at every boost. Under round robin the priority is kept but has no effect.
+ * It is an error if no thread with the given tid exists or if priority is not in [0, MLFQ_LEVELS).
+ *
+ * @param tid Thread ID.
+ * @param priority Priority level, 0 being the highest.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_set_priority(int tid, int priority);
+//--------------------------------------------------------------------------------------------------//
+/*
+ * Fair policy (attr->policy = UTHREAD_SCHED_FAIR): every thread accumulates virtual runtime, the time
+ * it ran (held a worker) scaled by FAIR_DEFAULT_WEIGHT / weight, and the scheduler always runs the READY
+ * thread with the least. So over time threads get CPU in proportion to their weights. New and woken
+ * threads start at most one quantum behind the least virtual runtime that was picked, so sleeping earns
+ * no credit beyond that. A thread the library wakes to run next (e.g. one whose channel operation
+ * another thread completed) runs at the worker's next switch whatever its virtual runtime. With several
+ * workers, all workers pick from a single set of READY threads.
+ */
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Sets the weight of a thread.
+ *
+ * Under the fair policy a thread of weight w gets w / FAIR_DEFAULT_WEIGHT times the CPU share of a
+ * default-weight thread. Under the other policies the weight is kept but has no effect.
+ * It is an error if no thread with the given tid exists or if weight is not positive.
+ *
+ * @param tid Thread ID.
+ * @param weight Weight of the thread.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_set_weight(int tid, int weight);
+//--------------------------------------------------------------------------------------------------//
 /**
  * @brief Returns the calling thread's ID.
  *
@@ -166,6 +519,314 @@ int uthread_get_total_quantums();
  * @return Number of quantums for the specified thread; -1 on error.
  */
 int uthread_get_quantums(int tid);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Runtime statistics of a thread and of the scheduler, filled in by uthread_get_stats.
+ *
+ * Times are in nanoseconds. They are taken at state changes and context switches with the time stamp counter
+ * on x86_64 (scaled to CLOCK_MONOTONIC when read, which assumes an invariant TSC) and with CLOCK_MONOTONIC
+ * elsewhere. Time running is the time the thread held a worker, which is its CPU time unless the kernel
+ * deschedules the worker. The totals include the state the thread is in right now.
+ */
+typedef struct {
+    long long run_ns;               /**< Time the thread spent running. */
+    long long ready_ns;             /**< Time the thread spent READY, waiting for a worker (run-queue latency). */
+    long long max_ready_ns;         /**< Longest single READY wait of the thread that has ended. */
+    long long blocked_ns;           /**< Time the thread spent BLOCKED: blocked, sleeping, or waiting on a primitive, channel, fd or offloaded call. */
+    long long voluntary_switches;   /**< Times the thread gave up the CPU itself (yield, block, sleep, wait, handoff). */
+    long long involuntary_switches; /**< Times the timer preempted the thread for another one. */
+    long long total_switches;       /**< Context switches of all workers, including to and from idle contexts. */
+    long long ticks_taken;          /**< Timer ticks that preempted or rescheduled the running thread right away. */
+    long long ticks_deferred;       /**< Timer ticks that hit a critical section and ran when it exited. */
+    long long elapsed_ns;           /**< Time since uthread_init, e.g. for switches per second. */
+} uthread_stats_t;
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Returns runtime statistics of a thread and of the scheduler.
+ *
+ * The counters are kept on the context switch and timer paths at the cost of one clock read per switch.
+ * An error is returned if no thread with the given tid exists or if out is NULL.
+ *
+ * @param tid Thread ID.
+ * @param out Where to store the statistics.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_get_stats(int tid, uthread_stats_t *out);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Returns the most stack the thread with the specified tid has used so far (its high-water mark).
+ *
+ * Needs the library to be initialized with measure_stacks or adaptive_stacks, unless the thread runs on the
+ * shared stack (see uthread_init_ex). The usage is measured to 8 bytes, and includes signal frames the
+ * thread was preempted with. An error is returned if no thread with the given tid exists, for the main
+ * thread, or if the thread's stack is not measured.
+ *
+ * @param tid Thread ID.
+ * @return Stack usage in bytes; -1 on error.
+ */
+ssize_t uthread_get_stack_usage(int tid);
+
+/* ===================================================================== */
+/*                       Synchronization Primitives                      */
+/* ===================================================================== */
+/*
+ * Mutexes, condition variables and semaphores keep their waiters in an intrusive FIFO queue.
+ * A waiting thread is BLOCKED and uses no CPU; releasing the primitive hands it (and, for mutexes and
+ * semaphores, the resource itself) directly to the READY queue. A waiting thread that is also blocked
+ * with uthread_block waits for uthread_resume after being woken; uthread_resume alone does not end a wait.
+ * Terminating a waiting thread removes it from the wait queue; terminating a mutex owner leaves the
+ * mutex locked. All functions return 0 on success and -1 on error.
+ */
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Non-recursive mutex. Initialize with uthread_mutex_init or UTHREAD_MUTEX_INITIALIZER.
+ */
+typedef struct {
+    int owner;                  /**< tid of the owning thread (-1 if unlocked). */
+    thread_queue_t waiters;     /**< Threads waiting in uthread_mutex_lock. */
+} uthread_mutex_t;
+
+#define UTHREAD_MUTEX_INITIALIZER { -1, { NULL, NULL } }
+
+/**
+ * @brief Condition variable. Initialize with uthread_cond_init or UTHREAD_COND_INITIALIZER.
+ */
+typedef struct {
+    thread_queue_t waiters;     /**< Threads waiting in uthread_cond_wait. */
+} uthread_cond_t;
+
+#define UTHREAD_COND_INITIALIZER { { NULL, NULL } }
+
+/**
+ * @brief Counting semaphore. Initialize with uthread_sem_init.
+ */
+typedef struct {
+    int value;                  /**< Units available (0 while threads are waiting). */
+    thread_queue_t waiters;     /**< Threads waiting in uthread_sem_wait. */
+} uthread_sem_t;
+//--------------------------------------------------------------------------------------------------//
+/** @brief Initializes an unlocked mutex. */
+int uthread_mutex_init(uthread_mutex_t *mutex);
+/** @brief Locks the mutex, waiting while another thread holds it. Locking a mutex the caller already holds is an error. */
+int uthread_mutex_lock(uthread_mutex_t *mutex);
+/** @brief Locks the mutex if it is free; returns -1 without waiting otherwise. */
+int uthread_mutex_trylock(uthread_mutex_t *mutex);
+/** @brief Unlocks the mutex, handing it to the longest waiter. Unlocking a mutex the caller doesn't hold is an error. */
+int uthread_mutex_unlock(uthread_mutex_t *mutex);
+//--------------------------------------------------------------------------------------------------//
+/** @brief Initializes a condition variable. */
+int uthread_cond_init(uthread_cond_t *cond);
+/** @brief Atomically unlocks the mutex (which the caller must hold) and waits; the mutex is locked again on return. */
+int uthread_cond_wait(uthread_cond_t *cond, uthread_mutex_t *mutex);
+/** @brief Wakes the longest waiter, if any. */
+int uthread_cond_signal(uthread_cond_t *cond);
+/** @brief Wakes all waiters. */
+int uthread_cond_broadcast(uthread_cond_t *cond);
+//--------------------------------------------------------------------------------------------------//
+/** @brief Initializes a semaphore with the given non-negative value. */
+int uthread_sem_init(uthread_sem_t *sem, int value);
+/** @brief Takes one unit, waiting while none is available. */
+int uthread_sem_wait(uthread_sem_t *sem);
+/** @brief Takes one unit if available; returns -1 without waiting otherwise. */
+int uthread_sem_trywait(uthread_sem_t *sem);
+/** @brief Returns one unit, handing it directly to the longest waiter if there is one. */
+int uthread_sem_post(uthread_sem_t *sem);
+
+/* ===================================================================== */
+/*                               Channels                                */
+/* ===================================================================== */
+/*
+ * A channel is a bounded FIFO of pointers: items are passed by pointer and never copied, so the
+ * receiver owns whatever the pointer refers to once it has it. A sender waits while the buffer is full
+ * and a receiver waits while it is empty, both BLOCKED like the synchronization primitives above.
+ * A send to a channel with a waiting receiver hands the item straight to that receiver and makes it the
+ * next thread to run, so a producer/consumer pair trades items with a single switch as soon as the
+ * producer gives up the CPU. A channel of capacity 0 has no buffer: every send meets a receiver.
+ * All functions return 0 on success and -1 on error.
+ */
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Bounded channel of pointers. Initialize with uthread_chan_init, release with uthread_chan_destroy.
+ */
+typedef struct {
+    void **buffer;              /**< Ring buffer of capacity items (NULL if capacity is 0). */
+    int capacity;               /**< Number of items the buffer holds. */
+    int head;                   /**< Index of the oldest buffered item. */
+    int count;                  /**< Number of buffered items. */
+    struct chan_waiter *senders;   /**< Threads waiting to send, oldest first. */
+    struct chan_waiter *receivers; /**< Threads waiting to receive, oldest first. */
+} uthread_chan_t;
+
+/** @brief Direction of a channel operation in uthread_chan_select. */
+typedef enum {
+    UTHREAD_CHAN_SEND,
+    UTHREAD_CHAN_RECV
+} uthread_chan_dir_t;
+
+/** @brief One operation of a uthread_chan_select call. */
+typedef struct {
+    uthread_chan_t *chan;       /**< Channel to operate on. */
+    uthread_chan_dir_t dir;     /**< Send or receive. */
+    void *item;                 /**< Item to send, or the received item once the operation completed. */
+} uthread_chan_op_t;
+//--------------------------------------------------------------------------------------------------//
+/** @brief Initializes an empty channel holding up to capacity (>= 0) items. */
+int uthread_chan_init(uthread_chan_t *chan, int capacity);
+/** @brief Releases the channel's buffer. No thread may be waiting on the channel. */
+int uthread_chan_destroy(uthread_chan_t *chan);
+/** @brief Sends an item, waiting while the channel is full. */
+int uthread_chan_send(uthread_chan_t *chan, void *item);
+/** @brief Receives the oldest item into *item, waiting while the channel is empty. */
+int uthread_chan_recv(uthread_chan_t *chan, void **item);
+/** @brief Sends an item if that can be done without waiting; returns -1 otherwise. */
+int uthread_chan_trysend(uthread_chan_t *chan, void *item);
+/** @brief Receives an item into *item if one is available without waiting; returns -1 otherwise. */
+int uthread_chan_tryrecv(uthread_chan_t *chan, void **item);
+/**
+ * @brief Performs exactly one of several channel operations.
+ *
+ * Completes the first operation (in array order) that can proceed without waiting. If none can and
+ * block is true, waits on all of the channels at once until one operation completes; a channel may
+ * appear more than once. The received item of a completed receive is stored in its op's item field.
+ *
+ * @param ops Array of operations.
+ * @param num_ops Number of operations (at least 1).
+ * @param block Whether to wait when no operation can proceed immediately.
+ * @return Index of the completed operation, or -1 on error or if block is false and none could proceed.
+ */
+int uthread_chan_select(uthread_chan_op_t *ops, int num_ops, bool block);
+
+/* ===================================================================== */
+/*                            Non-blocking I/O                           */
+/* ===================================================================== */
+/*
+ * These wrappers behave like the system calls they are named after, but only the calling thread waits:
+ * the fd is switched to non-blocking mode, and whenever the call would block the thread is parked BLOCKED
+ * until a single epoll instance reports the fd ready. The scheduler polls that instance (without waiting)
+ * on every switch while threads are parked on I/O, and idle workers block in it.
+ * On failure they return -1 and set errno like the system call. A thread parked on an fd must not have
+ * that fd closed under it.
+ */
+//--------------------------------------------------------------------------------------------------//
+/** @brief Like read(2), parking the calling thread until the fd is readable. */
+ssize_t uthread_read(int fd, void *buf, size_t count);
+/** @brief Like write(2), parking the calling thread until the fd is writable. */
+ssize_t uthread_write(int fd, const void *buf, size_t count);
+/** @brief Like accept(2), parking the calling thread until a connection is pending. */
+int uthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+/** @brief Like connect(2), parking the calling thread until the connection is established or fails. */
+int uthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/* ===================================================================== */
+/*                            Blocking Calls                             */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+/** @brief Function run by uthread_offload. */
+typedef void *(*uthread_offload_fn)(void *arg);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Runs a call that may block the kernel thread (file I/O, fsync, stat, getaddrinfo, ...) on a helper.
+ *
+ * The calling thread is BLOCKED while one of OFFLOAD_THREADS helper kernel threads runs fn(arg); all other
+ * threads keep running meanwhile. The helper hands the finished call back through a lock-free list that
+ * the scheduler drains on every switch, which makes the caller READY again. errno as left by fn is
+ * restored in the caller. fn runs outside the library and must not call any uthread function.
+ * If the helpers can't be started, fn runs directly on the calling thread.
+ * If the caller is terminated meanwhile, the call still completes and its result is dropped.
+ * In shared-stack mode the caller's stack is copied out while it waits, so arg must not point into it:
+ * such an arg is rejected, returning NULL with errno set to EINVAL. Pass heap or static memory instead,
+ * and likewise for anything arg points to (which can't be checked).
+ *
+ * @param fn Function to run.
+ * @param arg Argument passed to fn.
+ * @return The value returned by fn; NULL with errno set to EINVAL if arg points into the shared stack.
+ */
+void *uthread_offload(uthread_offload_fn fn, void *arg);
+
+/* ===================================================================== */
+/*                                Tracing                                */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+/*
+ * While tracing is on, the library records scheduler events into a preallocated ring buffer: spawn,
+ * switch (with whether the timer preempted the thread), block, resume, sleep, wake (a BLOCKED thread
+ * becomes READY), terminate and timer tick. Each event costs a time stamp counter read and a few stores,
+ * with no allocation, lock or system call; while tracing is off it costs one test of a flag. When the ring
+ * is full the oldest events are overwritten. uthread_trace_dump writes the events in the Chrome trace event
+ * format, which Perfetto (ui.perfetto.dev) and chrome://tracing open: every uthread is a track with
+ * "running" and "ready" slices and an instant for every other event.
+ */
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Starts tracing into a new ring buffer of at least num_events events.
+ *
+ * Events recorded before (if any) are dropped.
+ *
+ * @param num_events Capacity of the ring buffer (rounded up to a power of two).
+ * @return 0 on success; -1 on error.
+ */
+int uthread_trace_start(int num_events);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Stops tracing. The recorded events are kept for uthread_trace_dump.
+ */
+void uthread_trace_stop();
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Writes the recorded events as Chrome trace JSON.
+ *
+ * Can be called while tracing is on; the events recorded so far are written. Timestamps are microseconds
+ * since uthread_init. It is an error if tracing was never started.
+ *
+ * @param out Stream to write to.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_trace_dump(FILE *out);
+
+/* ===================================================================== */
+/*                               Profiling                               */
+/* ===================================================================== */
+//--------------------------------------------------------------------------------------------------//
+/*
+ * The sampling profiler sends SIGPROF to every worker once per interval of that worker's CPU time. Each
+ * sample records the uthread that was running and its call stack, walked along the frame pointer chain
+ * and only within that thread's own stack, so a corrupt or missing frame pointer ends the walk instead of
+ * faulting. Code built without frame pointers (compile with -fno-omit-frame-pointer) only yields the
+ * interrupted function. uthread_profile_dump writes one line per distinct stack in the collapsed format
+ * read by flamegraph.pl and speedscope, e.g. "uthread 3;main;worker;parse 42", with the uthread as the
+ * root frame so every thread gets its own tower. Function names come from dladdr, so functions of the
+ * executable itself need it linked with -rdynamic; others are printed as module+offset.
+ * SIGPROF is installed with SA_RESTART, but system calls that are never restarted (e.g. epoll_wait,
+ * nanosleep) may return EINTR while the profiler runs.
+ */
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Starts the sampling profiler.
+ *
+ * Samples from an earlier run are dropped. Once max_samples samples are taken, further ones are only
+ * counted as dropped.
+ *
+ * @param interval_usecs CPU time in microseconds between two samples of a worker.
+ * @param max_samples Number of samples to make room for.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_profile_start(int interval_usecs, int max_samples);
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Stops the sampling profiler. The samples are kept for uthread_profile_dump.
+ */
+void uthread_profile_stop();
+//--------------------------------------------------------------------------------------------------//
+/**
+ * @brief Writes the samples taken so far as collapsed stacks, one line per uthread and stack.
+ *
+ * Stacks that print the same (e.g. two calls from one function) share a line. It is an error if the
+ * profiler was never started.
+ *
+ * @param out Stream to write to.
+ * @return Number of samples dropped because the buffer was full (0 if none); -1 on error.
+ */
+int uthread_profile_dump(FILE *out);
 
 /* ===================================================================== */
 /*              Internal Helper Functions and Structures                 */
@@ -179,15 +840,20 @@ int uthread_get_quantums(int tid);
 /**
  * @brief Scheduler: Selects the next thread to run.
  *
- * This function examines the READY queue and selects the next thread for execution.
- * It handles state transitions and triggers a context switch.
+ * If the running thread is still RUNNING it is moved to the end of the READY queue.
+ * The thread at the head of the worker's READY queue is then popped in O(1) and switched to; if that
+ * queue is empty, a READY thread is stolen from another worker. If nothing is READY, a thread that can
+ * still run keeps running, and otherwise the worker switches to its idle context, which blocks in
+ * epoll until an fd is ready, another thread becomes READY or the first sleeper is due.
  */
 void schedule_next(void);
 //--------------------------------------------------------------------------------------------------//
 /**
  * @brief Context switch helper.
  *
- * Uses sigsetjmp and siglongjmp to save the current thread's context and restore the context of the next thread.
+ * Saves the current thread's context and restores the context of the next thread, either with the
+ * assembly switch routine (UTHREAD_SWITCH_ASM) or with sigsetjmp and siglongjmp.
+ * Returns when the current thread is switched back in.
  *
  * @param current Pointer to the current thread's TCB.
  * @param next Pointer to the next thread's TCB.
@@ -197,22 +863,24 @@ void context_switch(thread_t *current, thread_t *next);
 /**
  * @brief Timer signal handler.
  *
- * Registered as the handler for timer signals, this function updates global quantum counters
- * and initiates a scheduling decision when a quantum expires.
+ * Called by the library's handler for timer signals, this function updates global quantum counters
+ * and initiates a scheduling decision when a quantum expires. If the signal interrupts one of the
+ * library's critical sections it only marks a reschedule as pending; the outermost critical section
+ * runs the deferred tick when it exits.
  *
  * @param signum The signal number (e.g., SIGVTALRM).
  */
 void timer_handler(int signum);
 //--------------------------------------------------------------------------------------------------//
 /**
- * @brief Initializes a thread's jump buffer.
+ * @brief Initializes a thread's context.
  *
- * Sets up the thread’s jump buffer for context switching by manually assigning the stack pointer
- * and program counter using sigsetjmp/siglongjmp techniques. You may need to perform architecture-specific
- * address translation (see provided reference implementation) when initializing the context.
+ * With UTHREAD_SWITCH_ASM, builds an initial switch frame at the top of the stack so that the first
+ * switch to the thread "returns" into the thread wrapper. Otherwise sets up the thread’s jump buffer by
+ * manually assigning the (pointer-mangled) stack pointer and program counter.
  *
  * @param tid Thread ID.
- * @param stack Pointer to the thread's allocated stack (a char array).
+ * @param stack Pointer to the thread's allocated stack (threads[tid].stack_size bytes).
  * @param entry_point Pointer to the thread's entry function.
  */
 void setup_thread(int tid, char *stack, thread_entry_point entry_point);